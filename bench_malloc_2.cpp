@@ -0,0 +1,223 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "os_malloc.h"
+
+#ifndef SPLIT_MIN_REMAINDER
+#define SPLIT_MIN_REMAINDER 0
+#endif
+#ifndef COALESCE
+#define COALESCE 0
+#endif
+#ifndef BEST_FIT
+#define BEST_FIT 0
+#endif
+#ifndef WILDERNESS
+#define WILDERNESS 0
+#endif
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD 0
+#endif
+
+// Usage: ./bench2 [benchmark|all]
+// Every benchmark runs in its own child process so it starts from a fresh
+// heap. Build with SPLIT_MIN_REMAINDER / COALESCE / BEST_FIT / WILDERNESS /
+// TRIM_THRESHOLD set to compare policies.
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Everything malloc_2 took from sbrk
+size_t heap_bytes() {
+    return _num_allocated_bytes() + _num_meta_data_bytes();
+}
+
+uint64_t next_random() {
+    static uint64_t x = 88172645463325252ull;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+// Mostly small objects with a tail of larger ones
+size_t mixed_size() {
+    uint64_t r = next_random();
+    int kind = r % 100;
+    r >>= 8;
+    if (kind < 80) return 16 + r % 240;
+    if (kind < 98) return 256 + r % 3840;
+    return 4096 + r % 61440;
+}
+
+// fragment: keeps a set of live objects and replaces a random one with an
+// object of random size, so holes of every size open up all over the heap.
+// Reports how far the heap grew past the largest amount ever live.
+void bench_fragment() {
+    const int slots = 2000;
+    const int ops = 200000;
+    std::vector<void*> ptrs(slots);
+    std::vector<size_t> sizes(slots);
+    size_t live = 0;
+    size_t peak = 0;
+    for (int i = 0; i < slots; i++) {
+        sizes[i] = mixed_size();
+        ptrs[i] = smalloc(sizes[i]);
+        live += sizes[i];
+    }
+    peak = live;
+
+    auto start = Clock::now();
+    for (int i = 0; i < ops; i++) {
+        int slot = next_random() % slots;
+        sfree(ptrs[slot]);
+        live -= sizes[slot];
+        sizes[slot] = mixed_size();
+        ptrs[slot] = smalloc(sizes[slot]);
+        live += sizes[slot];
+        if (live > peak) peak = live;
+    }
+    double secs = seconds_since(start);
+
+    std::cout << std::left << std::setw(12) << "fragment"
+              << std::right << std::setw(12) << std::fixed << std::setprecision(0) << 2.0 * ops / secs << " ops/sec"
+              << std::setw(10) << std::setprecision(1) << heap_bytes() / 1048576.0 << " MB heap"
+              << std::setw(10) << peak / 1048576.0 << " MB peak live"
+              << std::setw(8) << std::setprecision(2) << (double)heap_bytes() / peak << "x" << std::endl;
+    for (auto& p : ptrs) sfree(p);
+}
+
+// lookup: 100k blocks of random sizes with every other one free, then
+// malloc/free pairs of random sizes. Measures the cost of finding a block.
+void bench_lookup() {
+    const int blocks = 100000;
+    const int ops = 200000;
+    std::vector<void*> ptrs(blocks);
+    for (int i = 0; i < blocks; i++) {
+        ptrs[i] = smalloc(16 + next_random() % 4080);
+    }
+    for (int i = 0; i < blocks; i += 2) {
+        sfree(ptrs[i]);
+    }
+
+    auto start = Clock::now();
+    for (int i = 0; i < ops; i++) {
+        sfree(smalloc(16 + next_random() % 4080));
+    }
+    double secs = seconds_since(start);
+    std::cout << std::left << std::setw(12) << "lookup"
+              << std::right << std::setw(12) << std::fixed << std::setprecision(0) << 2.0 * ops / secs << " ops/sec"
+              << std::setw(10) << std::setprecision(1) << secs * 1e9 / ops << " ns/pair" << std::endl;
+    for (int i = 1; i < blocks; i += 2) sfree(ptrs[i]);
+}
+
+// append: a buffer grows 4 KB at a time to 1 MB with srealloc, as a log or
+// output buffer would, then is freed and built again.
+void bench_append() {
+    const int rounds = 20;
+    const size_t step = 4096;
+    const size_t end_size = 1 << 20;
+    size_t reallocs = 0;
+    auto start = Clock::now();
+    for (int r = 0; r < rounds; r++) {
+        char* buffer = nullptr;
+        for (size_t size = step; size <= end_size; size += step) {
+            buffer = (char*)srealloc(buffer, size);
+            buffer[size - 1] = 1;
+            reallocs++;
+        }
+        sfree(buffer);
+    }
+    double secs = seconds_since(start);
+    std::cout << std::left << std::setw(12) << "append"
+              << std::right << std::setw(12) << std::fixed << std::setprecision(0) << reallocs / secs << " ops/sec"
+              << std::setw(10) << std::setprecision(1) << heap_bytes() / 1048576.0 << " MB heap" << std::endl;
+}
+
+// peak: a job builds up 256 MB of mixed objects, frees it in allocation
+// order and goes idle. Reports how much of the heap is still mapped.
+void bench_peak() {
+    const size_t target = 256 << 20;
+    std::vector<void*> ptrs;
+    size_t live = 0;
+    char* base = (char*)sbrk(0);
+    while (live < target) {
+        size_t size = mixed_size();
+        ptrs.push_back(smalloc(size));
+        live += size;
+    }
+    size_t peak = (char*)sbrk(0) - base;
+    auto start = Clock::now();
+    for (void* p : ptrs) sfree(p);
+    double secs = seconds_since(start);
+    std::cout << std::left << std::setw(12) << "peak"
+              << std::right << std::setw(12) << std::fixed << std::setprecision(0) << ptrs.size() / secs << " frees/sec"
+              << std::setw(10) << std::setprecision(1) << peak / 1048576.0 << " MB peak"
+              << std::setw(10) << ((char*)sbrk(0) - base) / 1048576.0 << " MB idle" << std::endl;
+}
+
+// freeorder: n blocks of 64 bytes freed in random order, so every free lands
+// in the middle of a bin that already holds many blocks. Run for growing n,
+// the cost per free should stay flat.
+void bench_freeorder() {
+    for (int blocks : {10000, 50000, 100000}) {
+        std::vector<void*> ptrs(blocks);
+        for (int i = 0; i < blocks; i++) {
+            ptrs[i] = smalloc(64);
+        }
+        for (int i = blocks - 1; i > 0; i--) {
+            std::swap(ptrs[i], ptrs[next_random() % (i + 1)]);
+        }
+        auto start = Clock::now();
+        for (void* p : ptrs) sfree(p);
+        double secs = seconds_since(start);
+        std::cout << std::left << std::setw(12) << "freeorder"
+                  << std::right << std::setw(12) << blocks << " blocks"
+                  << std::setw(10) << std::fixed << std::setprecision(1) << secs * 1e9 / blocks << " ns/free" << std::endl;
+    }
+}
+
+struct Benchmark {
+    const char* name;
+    void (*run)();
+};
+
+Benchmark benchmarks[] = {
+    {"fragment", bench_fragment},
+    {"lookup", bench_lookup},
+    {"append", bench_append},
+    {"peak", bench_peak},
+    {"freeorder", bench_freeorder},
+};
+
+int main(int argc, char** argv) {
+    std::string only = argc > 1 ? argv[1] : "all";
+
+    std::cout << "malloc_2 benchmarks (split remainder " << SPLIT_MIN_REMAINDER
+              << ", coalescing " << (COALESCE ? "on" : "off")
+              << ", " << (BEST_FIT ? "best" : "first") << " fit"
+              << ", wilderness " << (WILDERNESS ? "on" : "off")
+              << ", trim threshold " << TRIM_THRESHOLD << "):" << std::endl;
+    for (const Benchmark& b : benchmarks) {
+        if (only != "all" && only != b.name) continue;
+        std::cout.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            b.run();
+            exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,404 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "os_malloc.h"
+
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 0
+#endif
+
+// Usage: ./bench3 [benchmark|all] [max_threads]
+// max_threads defaults to the number of hardware threads. Every benchmark runs
+// in its own child process so it starts from a fresh heap.
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void print_row(const char* name, int threads, double ops, double secs) {
+    std::cout << std::left << std::setw(12) << name
+              << std::right << std::setw(8) << threads
+              << std::setw(16) << std::fixed << std::setprecision(0) << ops / secs
+              << " ops/sec" << std::endl;
+}
+
+// Runs body(thread_index) on the given number of threads and returns the
+// wall-clock time of the slowest one.
+template <typename Body>
+double run_threads(int threads, Body body) {
+    std::vector<std::thread> pool;
+    auto start = Clock::now();
+    for (int t = 0; t < threads; t++) {
+        pool.emplace_back(body, t);
+    }
+    for (auto& th : pool) th.join();
+    return seconds_since(start);
+}
+
+// threadtest: every thread repeatedly allocates a batch of small objects and
+// frees them all again. Measures the pure alloc/free fast path.
+void bench_threadtest(int max_threads) {
+    const int rounds = 200;
+    const int batch = 1000;
+    for (int threads = 1; threads <= max_threads; threads++) {
+        double secs = run_threads(threads, [&](int) {
+            std::vector<void*> ptrs(batch);
+            for (int r = 0; r < rounds; r++) {
+                for (int i = 0; i < batch; i++) {
+                    ptrs[i] = smalloc(8 + (i % 8) * 8);
+                }
+                for (int i = 0; i < batch; i++) {
+                    sfree(ptrs[i]);
+                }
+            }
+        });
+        print_row("threadtest", threads, 2.0 * rounds * batch * threads, secs);
+    }
+}
+
+// larson: every thread owns a set of slots and keeps replacing a random slot
+// with an object of random size. The initial objects are allocated by the
+// main thread, so the first free of each slot is a cross-thread free.
+void bench_larson(int max_threads) {
+    const int slots = 1000;
+    const int ops = 200000;
+    for (int threads = 1; threads <= max_threads; threads++) {
+        std::vector<std::vector<void*>> owned(threads, std::vector<void*>(slots));
+        for (auto& set : owned) {
+            for (auto& p : set) p = smalloc(16 + rand() % 2032);
+        }
+        double secs = run_threads(threads, [&](int t) {
+            unsigned int seed = t + 1;
+            std::vector<void*>& set = owned[t];
+            for (int i = 0; i < ops; i++) {
+                int slot = rand_r(&seed) % slots;
+                sfree(set[slot]);
+                set[slot] = smalloc(16 + rand_r(&seed) % 2032);
+            }
+        });
+        for (auto& set : owned) {
+            for (auto& p : set) sfree(p);
+        }
+        print_row("larson", threads, 2.0 * ops * threads, secs);
+    }
+}
+
+// orderscan: only whole order-MAX_ORDER blocks are free, so an smalloc of
+// order k finds every order from k to MAX_ORDER - 1 empty and splits a root
+// down to k. The sfree right after merges it back, which restores that
+// state for the next call. Splits and merges grow with the number of empty
+// orders; finding the order to split from should not add to that.
+void bench_orderscan(int) {
+    const int max_order = 10;
+    const int calls = 1000000;
+    size_t root_payload = (128 << max_order) - _size_meta_data();
+    sfree(smalloc(root_payload)); // maps the first root
+    if (_num_free_bytes() != _num_free_blocks() * root_payload) {
+        std::cerr << "orderscan: free blocks below MAX_ORDER" << std::endl;
+        exit(1);
+    }
+    for (int order = 0; order <= max_order; order++) {
+        size_t size = (128 << order) - _size_meta_data();
+        auto start = Clock::now();
+        for (int i = 0; i < calls; i++) {
+            void* p = smalloc(size);
+            if (p == NULL) {
+                std::cerr << "orderscan: smalloc failed" << std::endl;
+                exit(1);
+            }
+            sfree(p);
+        }
+        double ns = seconds_since(start) * 1e9 / calls;
+        std::cout << std::left << std::setw(12) << "orderscan"
+                  << "order " << std::setw(4) << order
+                  << std::right << std::setw(3) << max_order - order << " empty orders"
+                  << std::setw(10) << std::fixed << std::setprecision(1) << ns << " ns/pair" << std::endl;
+    }
+}
+
+// freelist: frees every other order-0 block in address order, so each free
+// lands above every block already free at that order and nothing merges.
+// Reports the average cost of a free as the free list grows.
+void bench_freelist(int) {
+    const int max_free = 8192;
+    const int passes = 10;
+    size_t size = 128 - _size_meta_data();
+    std::vector<void*> ptrs(2 * max_free);
+    for (auto& p : ptrs) p = smalloc(size);
+    std::vector<double> window_secs(14, 0.0);
+
+    for (int pass = 0; pass < passes; pass++) {
+        int freed = 0;
+        for (int window = 0; (256 << window) <= max_free; window++) {
+            int end = 256 << window;
+            auto start = Clock::now();
+            for (; freed < end; freed++) {
+                sfree(ptrs[2 * freed]);
+            }
+            window_secs[window] += seconds_since(start);
+        }
+        // Allocation prefers low addresses, so this takes the same blocks back
+        for (int i = 0; i < freed; i++) {
+            ptrs[2 * i] = smalloc(size);
+        }
+    }
+    for (int window = 0; (256 << window) <= max_free; window++) {
+        int frees = passes * ((256 << window) - (window == 0 ? 0 : 128 << window));
+        std::cout << std::left << std::setw(12) << "freelist"
+                  << std::right << std::setw(6) << (window == 0 ? 0 : 128 << window)
+                  << "-" << std::left << std::setw(6) << (256 << window) << "free"
+                  << std::right << std::setw(10) << std::fixed << std::setprecision(1)
+                  << window_secs[window] * 1e9 / frees << " ns/free" << std::endl;
+    }
+}
+
+// Bytes of heap held by blocks that are currently handed out
+size_t heap_in_use() {
+    size_t blocks = _num_allocated_blocks() - _num_free_blocks();
+    return _num_allocated_bytes() - _num_free_bytes() + blocks * _size_meta_data();
+}
+
+// footprint: heap consumed per live object for common small request sizes
+void bench_footprint(int) {
+    const int objects = 1000;
+    const size_t sizes[] = {16, 48, 100, 112, 200, 240, 1000, 4000};
+    std::vector<void*> ptrs(objects);
+    for (size_t size : sizes) {
+        size_t before = heap_in_use();
+        for (auto& p : ptrs) p = smalloc(size);
+        double per_object = (double)(heap_in_use() - before) / objects;
+        for (auto& p : ptrs) sfree(p);
+        std::cout << std::left << std::setw(12) << "footprint"
+                  << std::right << std::setw(6) << size << " bytes"
+                  << std::setw(10) << std::fixed << std::setprecision(0) << per_object << " bytes/object"
+                  << std::setw(8) << std::setprecision(0) << 100.0 * (per_object - size) / per_object
+                  << "% overhead" << std::endl;
+    }
+}
+
+// largebuf: every thread allocates, touches and frees buffers of 256 KB to
+// 2 MB, the pattern of a request handler. Reports the mmap cache hit rate.
+void bench_largebuf(int max_threads) {
+    const int ops = 20000;
+    for (int threads = 1; threads <= max_threads; threads++) {
+        size_t hits = _num_mmap_cache_hits();
+        size_t misses = _num_mmap_cache_misses();
+        double secs = run_threads(threads, [&](int t) {
+            unsigned int seed = t + 1;
+            for (int i = 0; i < ops; i++) {
+                size_t size = (256 << (rand_r(&seed) % 4)) * 1024;
+                char* p = (char*)smalloc(size);
+                for (size_t offset = 0; offset < size; offset += 4096) p[offset] = 1;
+                sfree(p);
+            }
+        });
+        hits = _num_mmap_cache_hits() - hits;
+        misses = _num_mmap_cache_misses() - misses;
+        print_row("largebuf", threads, 2.0 * ops * threads, secs);
+        std::cout << std::left << std::setw(12) << "" << std::right << std::setw(8) << ""
+                  << std::setw(16) << std::setprecision(1) << 100.0 * hits / (hits + misses + (hits + misses == 0))
+                  << " % cache hits" << std::endl;
+    }
+}
+
+// growbuf: a log buffer that starts at 1 MB and doubles up to 64 MB with
+// srealloc, written in full at every size.
+void bench_growbuf(int) {
+    const int rounds = 20;
+    const size_t start_size = 1 << 20;
+    const size_t end_size = 64 << 20;
+    double realloc_secs = 0;
+    for (int r = 0; r < rounds; r++) {
+        size_t size = start_size;
+        char* p = (char*)smalloc(size);
+        memset(p, 1, size);
+        while (size < end_size) {
+            auto start = Clock::now();
+            p = (char*)srealloc(p, 2 * size);
+            realloc_secs += seconds_since(start);
+            memset(p + size, 1, size);
+            size *= 2;
+        }
+        sfree(p);
+    }
+    std::cout << std::left << std::setw(12) << "growbuf"
+              << std::right << std::setw(16) << std::fixed << std::setprecision(1)
+              << realloc_secs * 1e6 / (rounds * 6) << " us/srealloc" << std::endl;
+}
+
+// batch: 1000 graph nodes allocated and freed together, one call at a time
+// against smalloc_batch / sfree_batch
+void bench_batch(int) {
+    const int rounds = 2000;
+    const int nodes = 1000;
+    const size_t sizes[] = {48, 200};
+    std::vector<void*> ptrs(nodes);
+    for (size_t size : sizes) {
+        auto start = Clock::now();
+        for (int r = 0; r < rounds; r++) {
+            for (auto& p : ptrs) p = smalloc(size);
+            for (auto& p : ptrs) sfree(p);
+        }
+        double single = seconds_since(start);
+        start = Clock::now();
+        for (int r = 0; r < rounds; r++) {
+            smalloc_batch(size, nodes, ptrs.data());
+            sfree_batch(ptrs.data(), nodes);
+        }
+        double batched = seconds_since(start);
+        std::cout << std::left << std::setw(12) << "batch"
+                  << std::right << std::setw(6) << size << " bytes"
+                  << std::setw(10) << std::fixed << std::setprecision(1)
+                  << single * 1e9 / (2.0 * rounds * nodes) << " ns/op single"
+                  << std::setw(10) << batched * 1e9 / (2.0 * rounds * nodes) << " ns/op batched" << std::endl;
+    }
+}
+
+// sizedfree: frees 200000 cold objects in random order with sfree and
+// with sfree_sized
+void bench_sizedfree(int) {
+    const int objects = 200000;
+    const int rounds = 5;
+    const size_t sizes[] = {48, 200};
+    std::vector<void*> ptrs(objects);
+    for (size_t size : sizes) {
+        double secs[2] = {0, 0};
+        for (int r = 0; r < 2 * rounds; r++) {
+            for (auto& p : ptrs) p = smalloc(size);
+            unsigned int seed = r;
+            for (int i = objects - 1; i > 0; i--) std::swap(ptrs[i], ptrs[rand_r(&seed) % (i + 1)]);
+            auto start = Clock::now();
+            if (r % 2 == 0) {
+                for (auto p : ptrs) sfree(p);
+            } else {
+                for (auto p : ptrs) sfree_sized(p, size);
+            }
+            secs[r % 2] += seconds_since(start);
+        }
+        std::cout << std::left << std::setw(12) << "sizedfree"
+                  << std::right << std::setw(6) << size << " bytes"
+                  << std::setw(10) << std::fixed << std::setprecision(1)
+                  << secs[0] * 1e9 / (rounds * objects) << " ns/sfree"
+                  << std::setw(10) << secs[1] * 1e9 / (rounds * objects) << " ns/sfree_sized" << std::endl;
+    }
+}
+
+// calloc: scalloc of a 64 MB buffer that is then freed, timed on its own.
+// The first call maps fresh pages, the rest reuse the cached mapping.
+void bench_calloc(int) {
+    const int rounds = 50;
+    const size_t size = 64 << 20;
+    double secs = 0;
+    for (int r = 0; r < rounds; r++) {
+        auto start = Clock::now();
+        char* p = (char*)scalloc(size, 1);
+        secs += seconds_since(start);
+        p[r * 4096] = 1;
+        sfree(p);
+    }
+    std::cout << std::left << std::setw(12) << "calloc"
+              << std::right << std::setw(16) << std::fixed << std::setprecision(1)
+              << secs * 1e6 / rounds << " us/scalloc" << std::endl;
+}
+
+// Huge pages backing this process, from /proc/self/smaps_rollup
+size_t anon_huge_kb() {
+    std::ifstream smaps("/proc/self/smaps_rollup");
+    std::string key;
+    size_t kb;
+    while (smaps >> key) {
+        if (key == "AnonHugePages:" && smaps >> kb) return kb;
+    }
+    return 0;
+}
+
+// randaccess: random 8-byte updates over 80 MB of 2000-byte heap objects
+// and over one 64 MB mmap block. Dominated by TLB misses, so it shows
+// what the HUGE_PAGES mode buys.
+void bench_randaccess(int) {
+    const int objects = 40000;
+    const size_t object_size = 2000;
+    const size_t large_size = 64 << 20;
+    const int accesses = 20000000;
+
+    std::vector<uint64_t*> ptrs(objects);
+    for (auto& p : ptrs) {
+        p = (uint64_t*)smalloc(object_size);
+        memset(p, 0, object_size);
+    }
+    uint64_t* large = (uint64_t*)smalloc(large_size);
+    memset(large, 0, large_size);
+
+    uint64_t x = 88172645463325252ull;
+    auto next = [&x]() {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return x;
+    };
+    auto start = Clock::now();
+    for (int i = 0; i < accesses; i++) {
+        uint64_t r = next();
+        ptrs[r % objects][(r >> 32) % (object_size / 8)]++;
+    }
+    print_row(HUGE_PAGES ? "rand-heap-h" : "rand-heap", 1, accesses, seconds_since(start));
+    start = Clock::now();
+    for (int i = 0; i < accesses; i++) {
+        large[next() % (large_size / 8)]++;
+    }
+    print_row(HUGE_PAGES ? "rand-large-h" : "rand-large", 1, accesses, seconds_since(start));
+    std::cout << std::left << std::setw(12) << "randaccess" << std::right << std::setw(24)
+              << anon_huge_kb() / 1024 << " MB in huge pages" << std::endl;
+
+    sfree(large);
+    for (auto& p : ptrs) sfree(p);
+}
+
+struct Benchmark {
+    const char* name;
+    void (*run)(int max_threads);
+};
+
+Benchmark benchmarks[] = {
+    {"threadtest", bench_threadtest},
+    {"larson", bench_larson},
+    {"orderscan", bench_orderscan},
+    {"freelist", bench_freelist},
+    {"footprint", bench_footprint},
+    {"largebuf", bench_largebuf},
+    {"growbuf", bench_growbuf},
+    {"randaccess", bench_randaccess},
+    {"calloc", bench_calloc},
+    {"batch", bench_batch},
+    {"sizedfree", bench_sizedfree},
+};
+
+int main(int argc, char** argv) {
+    std::string only = argc > 1 ? argv[1] : "all";
+    int max_threads = argc > 2 ? atoi(argv[2]) : (int)std::thread::hardware_concurrency();
+    if (max_threads < 1) max_threads = 1;
+
+    std::cout << "malloc_3 benchmarks (up to " << max_threads << " threads):" << std::endl;
+    for (const Benchmark& b : benchmarks) {
+        if (only != "all" && only != b.name) continue;
+        std::cout.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            b.run(max_threads);
+            exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    return 0;
+}
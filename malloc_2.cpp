@@ -2,6 +2,9 @@
 #include <iostream>
 #include <unistd.h>
 #include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <sys/mman.h>
 
 const int MAX_SIZE = 1e8;
 
@@ -11,48 +14,284 @@ size_t allocated_blocks = 0;
 size_t allocated_bytes = 0;
 
 
+// 48 bytes on 64-bit: the tree links cost 16 bytes per block, allocated or
+// not, since a payload can be as small as one byte and cannot hold them.
 struct MallocMetadata {
     size_t size = 0;
     bool is_free = false;
+    bool is_zero = false; // fresh from sbrk, the kernel zeroed it
+    // Free blocks only: the largest size in the subtree of this block, capped
+    // at 32 bits (far above MAX_SIZE) so it fits in the padding
+    uint32_t max_size = 0;
     MallocMetadata* next = nullptr;
     MallocMetadata* prev = nullptr;
+    // Free blocks only: the children in the tree of their size bin, or in
+    // the best-fit tree
+    MallocMetadata* left = nullptr;
+    MallocMetadata* right = nullptr;
 };
 
 MallocMetadata* firstMeta = nullptr;
 
-void* smalloc(size_t size){
-    if (size <= 0) return nullptr;
-    if (size > MAX_SIZE) return nullptr;
-    MallocMetadata* ptr  = firstMeta;
+// With BEST_FIT, smalloc takes the smallest free block that fits (the lowest
+// one among equal sizes) instead of the lowest one.
+#ifndef BEST_FIT
+#define BEST_FIT 0
+#endif
 
-//	Searches for a free block with at least
-// ‘size’ bytes
-    if(ptr != nullptr){
-        do  {
-            if ( ptr !=nullptr &&
-                 ptr->is_free &&
-                 ptr->size >= size) {
-                ptr->is_free = false;
-                free_blocks--;
-                free_bytes -= ptr->size;
-                return (void*)(ptr + 1);
-            }
-            else {
-                ptr = ptr->next;
-            }
-        } while (ptr != firstMeta);
+// Free blocks are kept in treaps: ordered by address in each size bin, or by
+// size and then address in the single best-fit tree. A node's priority is a
+// hash of its address, so the tree needs no fields beyond the two children
+// and max_size.
+uint64_t tree_priority(MallocMetadata* node){
+    return ((uintptr_t)node >> 3) * 0x9E3779B97F4A7C15ull;
+}
+
+bool tree_less(MallocMetadata* a, MallocMetadata* b){
+    if (BEST_FIT && a->size != b->size) return a->size < b->size;
+    return a < b;
+}
+
+uint32_t tree_max(MallocMetadata* node){
+    return node == nullptr ? 0 : node->max_size;
+}
+
+// Recomputes max_size once the children of node are final
+MallocMetadata* tree_update(MallocMetadata* node){
+    uint32_t own = std::min(node->size, (size_t)UINT32_MAX);
+    node->max_size = std::max({own, tree_max(node->left), tree_max(node->right)});
+    return node;
+}
+
+MallocMetadata* tree_insert(MallocMetadata* root, MallocMetadata* node){
+    if (root == nullptr) {
+        node->left = nullptr;
+        node->right = nullptr;
+        return tree_update(node);
+    }
+    if (tree_less(node, root)) {
+        root->left = tree_insert(root->left, node);
+        if (tree_priority(root->left) > tree_priority(root)) {
+            MallocMetadata* top = root->left; // rotate right
+            root->left = top->right;
+            top->right = tree_update(root);
+            return tree_update(top);
+        }
+    } else {
+        root->right = tree_insert(root->right, node);
+        if (tree_priority(root->right) > tree_priority(root)) {
+            MallocMetadata* top = root->right; // rotate left
+            root->right = top->left;
+            top->left = tree_update(root);
+            return tree_update(top);
+        }
     }
+    return tree_update(root);
+}
 
-//  allocates (sbrk()) -- none are found.
-    auto* meta = (MallocMetadata*) sbrk( sizeof(MallocMetadata) + size ) ;
-	if(meta == (void*)-1 ) return nullptr;
+// Joins two treaps where every node of low sorts before every node of high
+MallocMetadata* tree_join(MallocMetadata* low, MallocMetadata* high){
+    if (low == nullptr) return high;
+    if (high == nullptr) return low;
+    if (tree_priority(low) > tree_priority(high)) {
+        low->right = tree_join(low->right, high);
+        return tree_update(low);
+    }
+    high->left = tree_join(low, high->left);
+    return tree_update(high);
+}
 
-    ptr = meta + 1; // pointer to the first allocated byte within the allocated block.
+MallocMetadata* tree_remove(MallocMetadata* root, MallocMetadata* node){
+    if (root == node) return tree_join(root->left, root->right);
+    if (tree_less(node, root)) {
+        root->left = tree_remove(root->left, node);
+    } else {
+        root->right = tree_remove(root->right, node);
+    }
+    return tree_update(root);
+}
 
-    meta->size = size;
+MallocMetadata* free_tree = nullptr;
+
+MallocMetadata* tree_best_fit(size_t size){
+    MallocMetadata* best = nullptr;
+    MallocMetadata* node = free_tree;
+    while (node != nullptr) {
+        if (node->size >= size) {
+            best = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return best;
+}
+
+// Lowest block of an address-ordered tree with at least size bytes.
+// max_size tells which subtree holds one.
+MallocMetadata* tree_first_fit(MallocMetadata* node, size_t size){
+    if (tree_max(node) < size) return nullptr;
+    while (true) {
+        if (tree_max(node->left) >= size) node = node->left;
+        else if (node->size >= size) return node;
+        else node = node->right;
+    }
+}
+
+// Without BEST_FIT, free blocks are kept in size bins so smalloc only looks
+// at blocks that may fit. Sizes up to SMALL_BIN_MAX get a bin every
+// SMALL_BIN_STEP bytes, larger ones four bins per power of two. Each bin is
+// an address-ordered tree, which keeps the first-fit choice of the
+// whole-list walk (the lowest block that fits) at O(log n) per free.
+const size_t SMALL_BIN_STEP = 8;
+const size_t SMALL_BIN_MAX = 512;
+const int SMALL_BINS = SMALL_BIN_MAX / SMALL_BIN_STEP;
+const int NUM_BINS = SMALL_BINS + 4 * (64 - 9);
+const int BIN_WORDS = (NUM_BINS + 63) / 64;
+
+MallocMetadata* bin_roots[NUM_BINS] = {nullptr};
+MallocMetadata* bin_heads[NUM_BINS] = {nullptr}; // lowest block of each bin
+uint64_t nonempty_bins[BIN_WORDS] = {0};
+
+int bin_of(size_t size){
+    if (size <= SMALL_BIN_MAX) return (size - 1) / SMALL_BIN_STEP;
+    int log = 63 - __builtin_clzll(size); // at least 9
+    return SMALL_BINS + (log - 9) * 4 + ((size >> (log - 2)) & 3);
+}
+
+void bin_insert(MallocMetadata* meta){
+    int bin = bin_of(meta->size);
+    bin_roots[bin] = tree_insert(bin_roots[bin], meta);
+    if (bin_heads[bin] == nullptr || meta < bin_heads[bin]) bin_heads[bin] = meta;
+    nonempty_bins[bin / 64] |= uint64_t(1) << (bin % 64);
+}
+
+void bin_remove(MallocMetadata* meta){
+    int bin = bin_of(meta->size);
+    bin_roots[bin] = tree_remove(bin_roots[bin], meta);
+    if (bin_heads[bin] == meta) {
+        MallocMetadata* head = bin_roots[bin];
+        while (head != nullptr && head->left != nullptr) {
+            head = head->left;
+        }
+        bin_heads[bin] = head;
+    }
+    if (bin_roots[bin] == nullptr) {
+        nonempty_bins[bin / 64] &= ~(uint64_t(1) << (bin % 64));
+    }
+}
+
+// Lowest free block with at least size bytes. Only the bin of size has to
+// be searched; every block in a larger bin fits, so there the head is enough.
+MallocMetadata* find_free(size_t size){
+    int bin = bin_of(size);
+    MallocMetadata* found = tree_first_fit(bin_roots[bin], size);
+    for (int word = (bin + 1) / 64; word < BIN_WORDS; ++word) {
+        uint64_t bits = nonempty_bins[word];
+        if (word == (bin + 1) / 64) bits &= ~uint64_t(0) << ((bin + 1) % 64);
+        while (bits != 0) {
+            MallocMetadata* head = bin_heads[word * 64 + __builtin_ctzll(bits)];
+            if (found == nullptr || head < found) found = head;
+            bits &= bits - 1;
+        }
+    }
+    return found;
+}
+
+void mark_free(MallocMetadata* meta){
+    meta->is_free = true;
+    if (BEST_FIT) {
+        free_tree = tree_insert(free_tree, meta);
+    } else {
+        bin_insert(meta);
+    }
+    free_blocks++;
+    free_bytes += meta->size;
+}
+
+void unmark_free(MallocMetadata* meta){
+    if (BEST_FIT) {
+        free_tree = tree_remove(free_tree, meta);
+    } else {
+        bin_remove(meta);
+    }
     meta->is_free = false;
+    free_blocks--;
+    free_bytes -= meta->size;
+}
+
+// Part 2 reuses a free block whole and never merges neighbours, so both are
+// off by default. With SPLIT_MIN_REMAINDER > 0 a block is cut down to the
+// request when the rest can hold a header and at least that many bytes, and
+// with COALESCE a freed block absorbs its free neighbours right away.
+#ifndef SPLIT_MIN_REMAINDER
+#define SPLIT_MIN_REMAINDER 0
+#endif
+#ifndef COALESCE
+#define COALESCE 0
+#endif
+
+// The block list is in address order, so a block's neighbours are its list
+// links, as long as nothing else moved the break in between.
+bool adjacent(MallocMetadata* low, MallocMetadata* high){
+    return (char*)(low + 1) + low->size == (char*)high;
+}
+
+// Merges high, which must follow low in the list, into low
+void absorb(MallocMetadata* low, MallocMetadata* high){
+    low->size += sizeof(MallocMetadata) + high->size;
+    low->next = high->next;
+    high->next->prev = low;
+    allocated_blocks--;
+    allocated_bytes += sizeof(MallocMetadata);
+}
+
+void release(MallocMetadata* meta){
+    if (COALESCE) {
+        MallocMetadata* next = meta->next;
+        if (next != firstMeta && next->is_free && adjacent(meta, next)) {
+            unmark_free(next);
+            absorb(meta, next);
+        }
+        MallocMetadata* prev = meta->prev;
+        if (meta != firstMeta && prev->is_free && adjacent(prev, meta)) {
+            unmark_free(prev);
+            absorb(prev, meta);
+            meta = prev;
+        }
+    }
+    mark_free(meta);
+}
+
+// Cuts meta down to size bytes and frees the rest as a block of its own
+void split_block(MallocMetadata* meta, size_t size){
+    if (SPLIT_MIN_REMAINDER <= 0 ||
+        meta->size < size + sizeof(MallocMetadata) + SPLIT_MIN_REMAINDER) {
+        return;
+    }
+    auto* rest = (MallocMetadata*)((char*)(meta + 1) + size);
+    rest->size = meta->size - size - sizeof(MallocMetadata);
+    rest->is_zero = false;
+    rest->prev = meta;
+    rest->next = meta->next;
+    meta->next->prev = rest;
+    meta->next = rest;
+    meta->size = size;
     allocated_blocks++;
-    allocated_bytes += meta->size;
+    allocated_bytes -= sizeof(MallocMetadata);
+    release(rest);
+}
+
+// With WILDERNESS, the block at the program break grows in place by moving
+// the break: srealloc extends it instead of copying, and smalloc extends a
+// free one that is too small instead of adding a block after it. Part 2
+// expects a new block in both cases, so it is off by default.
+#ifndef WILDERNESS
+#define WILDERNESS 0
+#endif
+
+// Links a block in after the current last one
+void append_block(MallocMetadata* meta){
     if (firstMeta == nullptr) {
         firstMeta = meta;
         meta->next = meta;
@@ -67,8 +306,156 @@ void* smalloc(size_t size){
         previousLast->next = meta;
         firstMeta->prev = meta;
     }
+}
+
+// The last block, as long as it still ends at the break (nothing else
+// moved it)
+MallocMetadata* top_block(){
+    if (firstMeta == nullptr) return nullptr;
+    MallocMetadata* last = firstMeta->prev;
+    return (char*)(last + 1) + last->size == sbrk(0) ? last : nullptr;
+}
+
+bool at_break(MallocMetadata* meta){
+    return WILDERNESS && meta == top_block();
+}
+
+// Grows the block at the break to size bytes by moving the break
+bool grow_top(MallocMetadata* meta, size_t size){
+    if (sbrk(size - meta->size) == (void*)-1) return false;
+    allocated_bytes += size - meta->size;
+    meta->size = size;
+    return true;
+}
+
+// Once the free blocks at the top of the heap add up to TRIM_THRESHOLD bytes
+// (headers included), sfree hands them back to the kernel by moving the
+// break down. Part 2 keeps every block, so 0 turns it off; _strim() always
+// works.
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD 0
+#endif
+
+// The free block below block, if it directly touches it
+MallocMetadata* free_below(MallocMetadata* block){
+    if (block == firstMeta || !block->prev->is_free || !adjacent(block->prev, block)) return nullptr;
+    return block->prev;
+}
+
+size_t free_tail_bytes(){
+    size_t bytes = 0;
+    MallocMetadata* block = top_block();
+    if (block != nullptr && !block->is_free) block = nullptr;
+    for (; block != nullptr; block = free_below(block)) {
+        bytes += sizeof(MallocMetadata) + block->size;
+    }
+    return bytes;
+}
+
+// Releases the free blocks at the top of the heap with a single move of the
+// break and returns how many bytes it moved down
+size_t _strim(){
+    MallocMetadata* block = top_block();
+    if (block == nullptr || !block->is_free) return 0;
+    MallocMetadata* lowest = nullptr;
+    size_t released = 0;
+    size_t count = 0;
+    for (; block != nullptr; block = free_below(block)) {
+        lowest = block;
+        released += sizeof(MallocMetadata) + block->size;
+        count++;
+    }
+    for (block = lowest; ; block = block->next) {
+        unmark_free(block);
+        if (block->next == firstMeta) break;
+    }
+    // The headers are gone once the break moves
+    MallocMetadata* last = (lowest == firstMeta) ? nullptr : lowest->prev;
+    if (sbrk(-(intptr_t)released) == (void*)-1) {
+        for (block = lowest; ; block = block->next) {
+            mark_free(block);
+            if (block->next == firstMeta) break;
+        }
+        return 0;
+    }
+
+    if (last == nullptr) {
+        firstMeta = nullptr;
+    } else {
+        last->next = firstMeta;
+        firstMeta->prev = last;
+    }
+    allocated_blocks -= count;
+    allocated_bytes -= released - count * sizeof(MallocMetadata);
+    return released;
+}
+
+void maybe_trim(){
+#if TRIM_THRESHOLD > 0
+    if (free_tail_bytes() >= TRIM_THRESHOLD) {
+        _strim();
+    }
+#endif
+}
+
+void* smalloc(size_t size){
+    if (size <= 0) return nullptr;
+    if (size > MAX_SIZE) return nullptr;
+
+//	Searches for a free block with at least
+// ‘size’ bytes
+    MallocMetadata* ptr = BEST_FIT ? tree_best_fit(size) : find_free(size);
+    if (ptr != nullptr) {
+        unmark_free(ptr);
+        ptr->is_zero = false;
+        split_block(ptr, size);
+        return (void*)(ptr + 1);
+    }
+
+//  A free block at the break only needs the missing bytes
+    MallocMetadata* last = firstMeta == nullptr ? nullptr : firstMeta->prev;
+    if (last != nullptr && last->is_free && at_break(last)) {
+        unmark_free(last);
+        if (grow_top(last, size)) {
+            last->is_zero = false;
+            return (void*)(last + 1);
+        }
+        mark_free(last);
+    }
+
+//  allocates (sbrk()) -- none are found.
+    auto* meta = (MallocMetadata*) sbrk( sizeof(MallocMetadata) + size ) ;
+	if(meta == (void*)-1 ) return nullptr;
+
+    ptr = meta + 1; // pointer to the first allocated byte within the allocated block.
+
+    meta->size = size;
+    meta->is_free = false;
+    meta->is_zero = true;
+    allocated_blocks++;
+    allocated_bytes += meta->size;
+    append_block(meta);
     return ptr;
 }
+// Zeroes n bytes at p. Large ranges drop their whole pages with
+// MADV_DONTNEED, which the kernel refills with zeros on the next touch,
+// and only the partial pages at either end are written.
+const size_t MADVISE_ZERO_MIN = 128 * 1024;
+
+void zero_bytes(void* p, size_t n){
+    const size_t page = sysconf(_SC_PAGESIZE);
+    char* start = (char*)p;
+    char* end = start + n;
+    char* first_page = (char*)(((uintptr_t)start + page - 1) / page * page);
+    char* last_page = (char*)((uintptr_t)end / page * page);
+    if (n < MADVISE_ZERO_MIN || madvise(first_page, last_page - first_page, MADV_DONTNEED) != 0) {
+        memset(p, 0, n);
+        return;
+    }
+    memset(start, 0, first_page - start);
+    memset(last_page, 0, end - last_page);
+}
+
 void* scalloc(size_t num, size_t size){
 if(num<= 0 || size <=0 ||  size > MAX_SIZE ||
  num*size > MAX_SIZE ) {return nullptr; }
@@ -76,7 +463,17 @@ if(num<= 0 || size <=0 ||  size > MAX_SIZE ||
     void* ptr = smalloc(num*size);
 	if (ptr == nullptr) {return nullptr; }
     //set to 0'z
-    memset(ptr, 0, num*size);
+    auto* meta = (MallocMetadata*)ptr - 1;
+    if (meta->is_zero) {
+        // Pages past the old break are new, only the rest of its page can be dirty
+        const size_t page = sysconf(_SC_PAGESIZE);
+        char* page_end = (char*)(((uintptr_t)meta + page - 1) / page * page);
+        if (page_end > (char*)ptr) {
+            memset(ptr, 0, std::min(num*size, (size_t)(page_end - (char*)ptr)));
+        }
+    } else {
+        zero_bytes(ptr, num*size);
+    }
 
     return ptr;
 }
@@ -88,10 +485,8 @@ void sfree(void* p) {
     if(meta_ptr->is_free){
         return;
     }
-    meta_ptr->is_free = true;
-
-    free_blocks++;
-    free_bytes += meta_ptr->size;
+    release(meta_ptr);
+    maybe_trim();
 }
 
 void* srealloc(void* oldp, size_t size) {
@@ -103,17 +498,31 @@ void* srealloc(void* oldp, size_t size) {
 
     MallocMetadata* old_meta_ptr = (MallocMetadata*) oldp - 1;
 
-    if (size <= old_meta_ptr->size) return oldp;
+    if (size <= old_meta_ptr->size) {
+        split_block(old_meta_ptr, size);
+        return oldp;
+    }
+    // A free block at the break right after this one is the wilderness too
+    MallocMetadata* next = old_meta_ptr->next;
+    if (next != firstMeta && next->is_free && adjacent(old_meta_ptr, next) && at_break(next)) {
+        unmark_free(next);
+        absorb(old_meta_ptr, next);
+        if (size <= old_meta_ptr->size) {
+            split_block(old_meta_ptr, size);
+            return oldp;
+        }
+    }
+    if (at_break(old_meta_ptr) && grow_top(old_meta_ptr, size)) {
+        return oldp;
+    }
     void* new_ptr = smalloc(size);
     if (new_ptr == nullptr) {return nullptr;}
 
 
     memmove (new_ptr,oldp,old_meta_ptr->size);
 
-    old_meta_ptr->is_free = true ;
-
-    free_blocks++;
-    free_bytes += old_meta_ptr->size;
+    release(old_meta_ptr);
+    maybe_trim();
 
     return new_ptr;
 }
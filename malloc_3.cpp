@@ -3,314 +3,1409 @@
 #include <cstring>
 #include <cmath>
 #include <sys/mman.h>
+#include <cstdint>
+#include <ctime>
+#include <atomic>
+#include <mutex>
+#include <cerrno>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
 
 const int MAX_SIZE = 100000000;
 const int MAX_ORDER = 10;
 const size_t BLOCK_SIZE = 128 * 1024;
-bool is_initialized = false;
-
-size_t free_blocks = 0;
-size_t free_bytes = 0;
-size_t allocated_blocks = 0;
-size_t allocated_bytes = 0;
-
-struct MallocMetadata {
-    size_t size = 0;
-    bool is_free = false;
-    MallocMetadata* next = nullptr;
-    MallocMetadata* prev = nullptr;
+const int INITIAL_HEAP_BLOCKS = 32;
+std::atomic<bool> is_initialized{false};
+
+// Checks that are too costly for the fast paths
+#ifndef MALLOC_DEBUG
+#define MALLOC_DEBUG 0
+#endif
+
+// The heap is one PROT_NONE reservation of MAX_HEAP_BLOCKS root blocks,
+// aligned to BLOCK_SIZE. Root blocks are committed as they are handed to the
+// buddy heap: INITIAL_HEAP_BLOCKS at first, then (factor - 1) times the
+// current size with a single mprotect whenever every root block is in use.
+#ifndef HEAP_GROWTH_FACTOR
+#define HEAP_GROWTH_FACTOR 2
+#endif
+#ifndef MAX_HEAP_BLOCKS
+#define MAX_HEAP_BLOCKS 8192
+#endif
+static_assert(HEAP_GROWTH_FACTOR >= 2, "the heap has to grow by at least one root block");
+
+// Opt-in huge page mode: the heap reservation and mappings of 2 MB and up
+// are aligned to HUGE_PAGE_SIZE and marked MADV_HUGEPAGE. Large mappings try
+// MAP_HUGETLB first and stop trying after the first failure.
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 0
+#endif
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+std::atomic<bool> hugetlb_failed{false};
+
+char* heap_base = nullptr;
+char* heap_end = nullptr; // one past the last committed root block
+std::atomic<int> heap_blocks{0};
+
+// Root blocks that have been fully free for AUTO_TRIM_DELAY_MS get their
+// pages handed back with TRIM_ADVICE (0 turns the automatic mode off;
+// _strim() always works). The pages stay committed and come back zeroed on
+// the next touch.
+#ifndef AUTO_TRIM_DELAY_MS
+#define AUTO_TRIM_DELAY_MS 1000
+#endif
+#ifndef TRIM_ADVICE
+#define TRIM_ADVICE MADV_DONTNEED
+#endif
+// Both guarded by order_locks[MAX_ORDER]
+uint64_t root_free_since[MAX_HEAP_BLOCKS];
+bool root_trimmed[MAX_HEAP_BLOCKS];
+std::atomic<uint64_t> last_trim_check{0};
+
+// Freed mmap regions are kept for reuse by later large requests instead of
+// being unmapped, up to MMAP_CACHE_MAX_BYTES in total. Bucket b holds the
+// mappings of [2^b, 2^(b+1)) pages, newest first. Regions that sat in the
+// cache for MMAP_CACHE_DECAY_MS are unmapped. 0 for either turns it off.
+#ifndef MMAP_CACHE_MAX_BYTES
+#define MMAP_CACHE_MAX_BYTES (32 * 1024 * 1024)
+#endif
+#ifndef MMAP_CACHE_DECAY_MS
+#define MMAP_CACHE_DECAY_MS 1000
+#endif
+const int MMAP_CACHE_BUCKETS = 16;
+
+// Per-thread cache: orders up to TCACHE_MAX_ORDER are served from a private
+// stack, refilled from / flushed to the shared free lists TCACHE_BATCH at a time.
+const int TCACHE_MAX_ORDER = 3;
+const int TCACHE_BATCH = 8;
+const int TCACHE_LIMIT = 32;
+
+// Each order has its own lock, taken one at a time (except by srealloc,
+// which takes a range in ascending order), so threads working on different
+// orders never contend.
+std::mutex order_locks[MAX_ORDER + 1];
+std::mutex mmap_lock;
+std::mutex grow_lock; // init() and grow_heap()
+
+std::atomic<size_t> free_blocks{0};
+std::atomic<size_t> free_bytes{0};
+std::atomic<size_t> allocated_blocks{0};
+std::atomic<size_t> allocated_bytes{0};
+std::atomic<size_t> mmap_blocks{0}; // these also carry an MmapHeader
+
+// Buddy blocks are 128 << order bytes, so only mmap blocks need a byte size.
+const int MMAP_ORDER = MAX_ORDER + 1;
+
+// Every block starts with this header. Free blocks are tracked by the free
+// maps and cached blocks link through their payload, so the header needs no
+// pointers; the padding keeps payloads 16-byte aligned.
+struct alignas(16) MallocMetadata {
+    uint32_t size = 0; // mmap blocks only: length of the whole mapping
+    int8_t order = 0;
+    bool is_free = false; // the free maps are the authority, this catches double frees
+    bool is_cached = false;
+    bool is_zero = false; // payload untouched since the kernel zeroed it
+    bool is_slab = false;
+    bool is_aligned = false; // see place_aligned()
 };
-MallocMetadata* free_lists[MAX_ORDER + 1] = {nullptr};
 
-MallocMetadata* mmap_list = nullptr;
+// mmap blocks keep their list links in front of the common header
+struct MmapHeader {
+    MmapHeader* next = nullptr;
+    MmapHeader* prev = nullptr;
+};
+// Free blocks of each order are kept as a bitmap with one bit per block slot
+// in the heap, plus summary levels on top (bit i of a summary word is set
+// while word i of the level below is non-zero). Insert and remove touch one
+// word per level, and the lowest-address free block is one ctz per level.
+const int BITMAP_LEVELS = 4;
+
+struct FreeBitmap {
+    uint64_t* level[BITMAP_LEVELS];
+    int top = 0; // the level that fits in a single word
+};
+FreeBitmap free_maps[MAX_ORDER + 1];
 
+constexpr int bitmap_depth(size_t bits) {
+    return bits <= 64 ? 1 : 1 + bitmap_depth((bits + 63) / 64);
+}
+static_assert(bitmap_depth((size_t)MAX_HEAP_BLOCKS << MAX_ORDER) <= BITMAP_LEVELS, "heap too large for the free maps");
 
+constexpr size_t bitmap_words(size_t bits) {
+    return bits <= 64 ? 1 : (bits + 63) / 64 + bitmap_words((bits + 63) / 64);
+}
+constexpr size_t all_bitmap_words(int order) {
+    return order > MAX_ORDER ? 0 :
+           bitmap_words((size_t)MAX_HEAP_BLOCKS << (MAX_ORDER - order)) + all_bitmap_words(order + 1);
+}
+uint64_t bitmap_storage[all_bitmap_words(0)] = {0};
+
+// Bit i is set while order i has a free block, so the smallest usable order
+// is one count-trailing-zeros away. Bits only change under the order's lock.
+static_assert(MAX_ORDER < 64, "nonempty_orders has one bit per order");
+std::atomic<uint64_t> nonempty_orders{0};
+
+MmapHeader* mmap_list = nullptr;
+
+// Requests of up to SLAB_MAX_SIZE bytes share SLAB_ORDER buddy blocks
+// ("slabs") cut into equal slots that carry no header. Each slab serves one
+// slot size, a multiple of 16, and keeps its free slots in a bitmap word.
+// A slot finds its slab by rounding down to the slab size, since buddy
+// blocks are aligned to their size. The statistics see a slab as one
+// allocated block.
+// Once there are threads, each one owns a slab of every class it allocates
+// from: the slab's free slots move into the thread cache, where the thread
+// takes and returns them without a lock. Slots of other slabs are handed
+// back under the lock, one slab at a time (see free_slot()).
+const int SLAB_ORDER = 3;
+const size_t SLAB_MAX_SIZE = 96;
+const int SLAB_CLASSES = SLAB_MAX_SIZE / 16;
+
+// Sits right after the slab's buddy header
+struct Slab {
+    Slab* next = nullptr; // slabs of the class with a free slot
+    Slab* prev = nullptr;
+    // Not counting the owner's. Only written under slab_locks of the class;
+    // free_slot() reads it without the lock as a hint.
+    std::atomic<uint64_t> free_slots{0};
+    uint32_t slot_size = 0;
+    uint16_t slot_count = 0;
+    bool owned = false; // by a thread cache, and off the partial list
+};
+static_assert(sizeof(Slab) % 16 == 0, "slots have to stay 16-byte aligned");
+
+// Guarded by slab_locks of the class
+Slab* partial_slabs[SLAB_CLASSES] = {nullptr};
+int slab_count[SLAB_CLASSES] = {0};
+std::mutex slab_locks[SLAB_CLASSES];
+
+// A cached region reuses the space of its old headers
+struct CachedRegion {
+    CachedRegion* next = nullptr; // older
+    CachedRegion* prev = nullptr; // newer
+    size_t length = 0;
+    uint64_t cached_at = 0;
+};
+static_assert(sizeof(CachedRegion) <= sizeof(MmapHeader) + sizeof(MallocMetadata), "cached region header too large");
+static_assert((MAX_SIZE >> 12) < (1 << MMAP_CACHE_BUCKETS), "not enough mmap cache buckets");
+
+// All guarded by mmap_lock
+CachedRegion* cache_heads[MMAP_CACHE_BUCKETS] = {nullptr};
+CachedRegion* cache_tails[MMAP_CACHE_BUCKETS] = {nullptr};
+std::atomic<size_t> mmap_cache_bytes{0};
+std::atomic<size_t> mmap_cache_hits{0};
+std::atomic<size_t> mmap_cache_misses{0};
+
+struct ThreadCache {
+    MallocMetadata* bins[TCACHE_MAX_ORDER + 1] = {nullptr}; // linked through the payload
+    int counts[TCACHE_MAX_ORDER + 1] = {0};
+    Slab* slabs[SLAB_CLASSES] = {nullptr}; // owned
+    uint64_t slab_slots[SLAB_CLASSES] = {0}; // free slots of the owned slab
+    Slab* pending[SLAB_CLASSES] = {nullptr}; // another slab with freed slots
+    uint64_t pending_slots[SLAB_CLASSES] = {0};
+    bool registered = false;
+    ~ThreadCache();
+};
+thread_local ThreadCache tcache;
+std::atomic<int> active_threads{0};
 
-void insert(int index, MallocMetadata* p){
-    MallocMetadata* current = free_lists[index];
-    if(current == nullptr){
-        free_lists[index] = p;
-        p->next = nullptr;
-        p->prev = nullptr;
+
+
+size_t block_size(int order){
+    return (size_t)128 << order;
+}
+
+size_t payload_size(MallocMetadata* meta){
+    if (meta->order == MMAP_ORDER) {
+        return meta->size - sizeof(MmapHeader) - sizeof(MallocMetadata);
     }
-    else{
-        while(current->next != nullptr && current->next < p){
-            current = current->next;
-        }
-        // Insert p after current
-        MallocMetadata* next_elem = current->next;
+    return block_size(meta->order) - sizeof(MallocMetadata);
+}
+
+MallocMetadata*& cache_link(MallocMetadata* meta){
+    return *(MallocMetadata**)(meta + 1);
+}
+
+// Smallest order whose blocks hold size bytes, capped at MAX_ORDER
+int find_order(size_t size){
+    if (size <= 128) return 0;
+    int order = 64 - __builtin_clzll(size - 1) - 7;
+    return order < MAX_ORDER ? order : MAX_ORDER;
+}
 
-        if(next_elem != nullptr){
-            next_elem->prev = p;
+void setup_bitmaps(){
+    uint64_t* next_word = bitmap_storage;
+    for (int order = 0; order <= MAX_ORDER; ++order) {
+        size_t bits = (size_t)MAX_HEAP_BLOCKS << (MAX_ORDER - order);
+        for (int l = 0; l < BITMAP_LEVELS; ++l) {
+            size_t words = (bits + 63) / 64;
+            free_maps[order].level[l] = next_word;
+            next_word += words;
+            if (words == 1) {
+                free_maps[order].top = l;
+                break;
+            }
+            bits = words;
         }
-        p->next = next_elem;
-        p->prev = current;
-        current->next = p;
     }
-    free_blocks++;
-    free_bytes += (p->size - sizeof(MallocMetadata));
 }
 
-void init(){
-    size_t total_size = 32 * BLOCK_SIZE;
-    intptr_t current_brk = (intptr_t)sbrk(0);
-    size_t padding = 0;
+size_t block_index(int order, MallocMetadata* p){
+    return (size_t)((char*)p - heap_base) >> (7 + order);
+}
 
-    if (current_brk % total_size != 0) {
-        padding = total_size - (current_brk % total_size);
+MallocMetadata* block_at(int order, size_t index){
+    return (MallocMetadata*)(heap_base + (index << (7 + order)));
+}
+
+bool bitmap_test(int order, size_t index){
+    return (free_maps[order].level[0][index / 64] >> (index % 64)) & 1;
+}
+
+void bitmap_set(int order, size_t index){
+    FreeBitmap& map = free_maps[order];
+    for (int l = 0; l <= map.top; ++l) {
+        uint64_t& word = map.level[l][index / 64];
+        bool was_empty = (word == 0);
+        word |= uint64_t(1) << (index % 64);
+        if (!was_empty) return;
+        index /= 64;
     }
-    void* ptr = sbrk(padding + total_size);
-    if(ptr == (void*)-1) return;
-    auto* first_block = (MallocMetadata*)((char*)ptr + padding);
+    nonempty_orders.fetch_or(uint64_t(1) << order);
+}
+
+void bitmap_clear(int order, size_t index){
+    FreeBitmap& map = free_maps[order];
+    for (int l = 0; l <= map.top; ++l) {
+        uint64_t& word = map.level[l][index / 64];
+        word &= ~(uint64_t(1) << (index % 64));
+        if (word != 0) return;
+        index /= 64;
+    }
+    nonempty_orders.fetch_and(~(uint64_t(1) << order));
+}
 
-    for (int i = 0; i < 32; ++i) {
-        auto* block = (MallocMetadata*)((char*)first_block + i * BLOCK_SIZE);
-        block->size = BLOCK_SIZE;
-        block->is_free = true;
+// Lowest free block of the order, or nullptr. Caller holds the order's lock.
+MallocMetadata* first_free(int order){
+    FreeBitmap& map = free_maps[order];
+    if (map.level[map.top][0] == 0) return nullptr;
+    size_t index = 0;
+    for (int l = map.top; l >= 0; --l) {
+        index = index * 64 + __builtin_ctzll(map.level[l][index]);
+    }
+    return block_at(order, index);
+}
+
+uint64_t now_ms(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void insert(int index, MallocMetadata* p){
+    if (index == MAX_ORDER) {
+        root_free_since[block_index(MAX_ORDER, p)] = now_ms();
+    }
+    bitmap_set(index, block_index(index, p));
+    p->order = index;
+    p->is_free = true;
+    free_blocks++;
+    free_bytes += (block_size(index) - sizeof(MallocMetadata));
+}
+
+void remove(int index, MallocMetadata* p){
+    if (index == MAX_ORDER) {
+        size_t root = block_index(MAX_ORDER, p);
+        if (root_trimmed[root]) {
+            // The header went back to the OS with the rest of the pages
+            p->order = MAX_ORDER;
+            p->is_cached = false;
+            p->is_slab = false;
+            p->is_aligned = false;
+            p->is_zero = (TRIM_ADVICE == MADV_DONTNEED);
+        }
+        root_trimmed[root] = false;
+    }
+    bitmap_clear(index, block_index(index, p));
+    p->is_free = false;
+    free_blocks--;
+    free_bytes -= (block_size(index) - sizeof(MallocMetadata));
+}
+
+void add_roots(char* start, int count){
+    std::lock_guard<std::mutex> guard(order_locks[MAX_ORDER]);
+    for (int i = 0; i < count; ++i) {
+        auto* block = (MallocMetadata*)(start + i * BLOCK_SIZE);
+        block->is_zero = true; // freshly committed pages
+        block->is_slab = false;
+        block->is_aligned = false;
         allocated_blocks++;
-        allocated_bytes += (block->size - sizeof(MallocMetadata));
+        allocated_bytes += (BLOCK_SIZE - sizeof(MallocMetadata));
         insert(MAX_ORDER, block);
     }
+    heap_end = start + count * BLOCK_SIZE;
+    heap_blocks += count;
+}
+
+void init(){
+    // Over-reserve by the alignment so the start can be aligned
+    size_t reserve_size = (size_t)MAX_HEAP_BLOCKS * BLOCK_SIZE;
+    size_t align = HUGE_PAGES ? HUGE_PAGE_SIZE : BLOCK_SIZE;
+    void* ptr = mmap(NULL, reserve_size + align, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(ptr == MAP_FAILED) return;
+    size_t padding = (align - (uintptr_t)ptr % align) % align;
+    if (padding != 0) {
+        munmap(ptr, padding);
+    }
+    munmap((char*)ptr + padding + reserve_size, align - padding);
+    heap_base = (char*)ptr + padding;
+    heap_end = heap_base;
+    if (HUGE_PAGES) {
+        madvise(heap_base, reserve_size, MADV_HUGEPAGE); // only a hint, ignore failure
+    }
+
+    if (mprotect(heap_base, INITIAL_HEAP_BLOCKS * BLOCK_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        munmap(heap_base, reserve_size);
+        return;
+    }
+    setup_bitmaps();
+    add_roots(heap_base, INITIAL_HEAP_BLOCKS);
     is_initialized = true;
 }
 
-int find_order(size_t size){
-    int order = 0;
-    size_t current_size = 128;
-    while (current_size < size && order < MAX_ORDER) {
-        current_size *= 2;
+void ensure_initialized(){
+    if (is_initialized) return;
+    std::lock_guard<std::mutex> guard(grow_lock);
+    if (!is_initialized) {
+        init();
+    }
+}
+
+// Commits a batch of root blocks. seen_blocks is the heap size the caller
+// found exhausted; if another thread grew the heap since, there is nothing to do.
+bool grow_heap(int seen_blocks){
+    std::lock_guard<std::mutex> guard(grow_lock);
+    if (heap_blocks != seen_blocks) return true;
+
+    size_t count = (size_t)seen_blocks * (HEAP_GROWTH_FACTOR - 1);
+    if (count > (size_t)(MAX_HEAP_BLOCKS - seen_blocks)) {
+        count = MAX_HEAP_BLOCKS - seen_blocks;
+    }
+    if (count == 0) return false;
+
+    if (mprotect(heap_end, count * BLOCK_SIZE, PROT_READ | PROT_WRITE) != 0) return false;
+    add_roots(heap_end, count);
+    return true;
+}
+
+// Takes a block of the given order from the free lists, splitting a larger one
+// if needed.
+MallocMetadata* buddy_alloc(int power){
+    int current_power;
+    MallocMetadata* output = nullptr;
+    while (output == nullptr) {
+        int seen_blocks = heap_blocks;
+        uint64_t candidates = nonempty_orders.load() & (~uint64_t(0) << power);
+        if (candidates == 0) {
+            if (!grow_heap(seen_blocks)) return nullptr;
+            continue;
+        }
+        current_power = __builtin_ctzll(candidates);
+
+        // Another thread may have emptied the order since the bit was read
+        std::lock_guard<std::mutex> guard(order_locks[current_power]);
+        output = first_free(current_power);
+        if (output != nullptr) {
+            //the block we want to use
+            remove(current_power, output);
+        }
+    }
+
+    //split
+    while(current_power > power){
+        current_power--;
+
+        auto* buddy = (MallocMetadata*)((char*)output + block_size(current_power));
+        buddy->is_cached = false;
+        buddy->is_zero = output->is_zero;
+        buddy->is_slab = false;
+        buddy->is_aligned = false;
+        {
+            std::lock_guard<std::mutex> guard(order_locks[current_power]);
+            insert(current_power, buddy);
+        }
+
+        output->order = current_power;
+        allocated_blocks++;
+        allocated_bytes -= sizeof(MallocMetadata);
+    }
+    return output;
+}
+
+// Returns a block to the free lists, merging it with free buddies. The buddy
+// check and the final insert happen under the same order lock, so two threads
+// freeing a pair of buddies at once always end up merging them. The caller
+// passes the order, so the header is only written, never read.
+void buddy_free(MallocMetadata* meta, int order){
+    meta->order = order;
+    meta->is_zero = false;
+
+    // Iterative Merge
+    while (true) {
+        std::lock_guard<std::mutex> guard(order_locks[order]);
+        if (order == MAX_ORDER) {
+            insert(order, meta);
+            return;
+        }
+
+        // XOR Trick to find buddy address
+        auto block_addr = (intptr_t)meta;
+        intptr_t buddy_addr = block_addr ^ block_size(order);
+        auto* buddy = (MallocMetadata*)buddy_addr;
+
+        // Check buddy is free at this order
+        if (!bitmap_test(order, block_index(order, buddy))) {
+            // Insert the final merged block
+            insert(order, meta);
+            return;
+        }
+
+        // Merge - remove buddy from free list
+        remove(order, buddy);
+
+        // Combine: The one with lower address becomes the start
+        if (buddy < meta) {
+            meta = buddy;
+        }
+
         order++;
+        meta->order = order;
+        meta->is_zero = false; // at least one half held data
+        allocated_blocks--;
+        allocated_bytes += sizeof(MallocMetadata);
     }
-    return order;
 }
 
-void remove(MallocMetadata* ptr){
-    int order = find_order(ptr->size);
+// The caches only pay off once several threads share the heap, so they stay
+// off until a second thread allocates. A single-threaded process keeps the
+// exact buddy behaviour (and statistics) of the uncached allocator.
+bool tcache_enabled(){
+    if (!tcache.registered) {
+        tcache.registered = true;
+        active_threads++;
+    }
+    return active_threads > 1;
+}
+
+// Cached blocks are allocated as far as the buddy lists are concerned, but
+// are reported as free by the statistics.
+void tcache_push(int order, MallocMetadata* meta){
+    meta->is_cached = true;
+    meta->is_zero = false;
+    cache_link(meta) = tcache.bins[order];
+    tcache.bins[order] = meta;
+    tcache.counts[order]++;
+    free_blocks++;
+    free_bytes += (block_size(order) - sizeof(MallocMetadata));
+}
+
+MallocMetadata* tcache_pop(int order){
+    MallocMetadata* meta = tcache.bins[order];
+    tcache.bins[order] = cache_link(meta);
+    tcache.counts[order]--;
+    meta->is_cached = false;
+    free_blocks--;
+    free_bytes -= (block_size(order) - sizeof(MallocMetadata));
+    return meta;
+}
 
-    if (ptr->prev == nullptr) {
-        // ptr is the head, update the array
-        free_lists[order] = ptr->next;
+// Moves up to TCACHE_BATCH blocks into the cache, taking whatever the order's
+// list holds under a single lock and splitting larger blocks for the rest.
+void tcache_refill(int order){
+    ensure_initialized();
+    int filled = 0;
+    while (filled < TCACHE_BATCH) {
+        {
+            std::lock_guard<std::mutex> guard(order_locks[order]);
+            MallocMetadata* meta;
+            while (filled < TCACHE_BATCH && (meta = first_free(order)) != nullptr) {
+                remove(order, meta);
+                tcache_push(order, meta);
+                filled++;
+            }
+        }
+        if (filled == TCACHE_BATCH) break;
+        MallocMetadata* meta = buddy_alloc(order);
+        if (meta == nullptr) break;
+        tcache_push(order, meta);
+        filled++;
+    }
+}
+
+int cache_bucket(size_t length){
+    return 63 - __builtin_clzll(length >> 12);
+}
+
+void cache_unlink(CachedRegion* region){
+    int bucket = cache_bucket(region->length);
+    if (region->prev == nullptr) {
+        cache_heads[bucket] = region->next;
+    } else {
+        region->prev->next = region->next;
+    }
+    if (region->next == nullptr) {
+        cache_tails[bucket] = region->prev;
     } else {
-        ptr->prev->next = ptr->next;
+        region->next->prev = region->prev;
     }
+    mmap_cache_bytes -= region->length;
+}
 
-    if(ptr->next != nullptr){
-        ptr->next->prev = ptr->prev;
+// Moves every region older than max_age_ms onto the dead list, which the
+// caller unmaps once mmap_lock is released.
+CachedRegion* cache_expire(uint64_t max_age_ms, CachedRegion* dead){
+    uint64_t now = now_ms();
+    for (int b = 0; b < MMAP_CACHE_BUCKETS; ++b) {
+        while (cache_tails[b] != nullptr && now - cache_tails[b]->cached_at >= max_age_ms) {
+            CachedRegion* region = cache_tails[b];
+            cache_unlink(region);
+            region->next = dead;
+            dead = region;
+        }
     }
+    return dead;
+}
 
-    ptr->next = nullptr;
-    ptr->prev = nullptr;
-    free_blocks--;
-    free_bytes -= (ptr->size - sizeof(MallocMetadata));
+size_t unmap_regions(CachedRegion* region){
+    size_t released = 0;
+    while (region != nullptr) {
+        CachedRegion* next = region->next;
+        released += region->length;
+        munmap(region, region->length);
+        region = next;
+    }
+    return released;
 }
 
-void* smalloc(size_t size){
-    if(!is_initialized){
-        init();
+// Hands back the pages of every root block that has been free for at least
+// idle_ms. Returns the number of bytes released.
+size_t trim_free_roots(uint64_t idle_ms){
+    std::lock_guard<std::mutex> guard(order_locks[MAX_ORDER]);
+    uint64_t now = now_ms();
+    size_t released = 0;
+    for (int root = 0; root < heap_blocks; ++root) {
+        if (root_trimmed[root] || !bitmap_test(MAX_ORDER, root)) continue;
+        if (now - root_free_since[root] < idle_ms) continue;
+        if (madvise(heap_base + root * BLOCK_SIZE, BLOCK_SIZE, TRIM_ADVICE) == 0) {
+            root_trimmed[root] = true;
+            released += BLOCK_SIZE;
+        }
     }
-    if (size <= 0 || size > MAX_SIZE) return nullptr;
-    size_t required_size = size + sizeof(MallocMetadata);
+    return released;
+}
 
-    int power = find_order(required_size);
+// Called on the free path; at most once per delay it looks for idle root
+// blocks and unmaps cached mmap regions past MMAP_CACHE_DECAY_MS, so a
+// process that stops making large requests does not keep them forever.
+void maybe_trim(){
+    uint64_t delay = AUTO_TRIM_DELAY_MS != 0 ? AUTO_TRIM_DELAY_MS : MMAP_CACHE_DECAY_MS;
+    if (delay == 0) return;
+    uint64_t now = now_ms();
+    uint64_t last = last_trim_check;
+    if (now - last < delay) return;
+    if (!last_trim_check.compare_exchange_strong(last, now)) return;
+    if (AUTO_TRIM_DELAY_MS != 0) {
+        trim_free_roots(AUTO_TRIM_DELAY_MS);
+    }
+    if (MMAP_CACHE_DECAY_MS != 0) {
+        CachedRegion* dead;
+        {
+            std::lock_guard<std::mutex> guard(mmap_lock);
+            dead = cache_expire(MMAP_CACHE_DECAY_MS, nullptr);
+        }
+        unmap_regions(dead);
+    }
+}
 
-    // large block
-    if (required_size > BLOCK_SIZE ) {
-        void* out = nullptr;
+void tcache_flush(int order, int count){
+    for (int i = 0; i < count && tcache.counts[order] > 0; ++i) {
+        buddy_free(tcache_pop(order), order);
+    }
+    maybe_trim();
+}
 
-        //TODO:change required to a multiple of page size
-        out = (void*) mmap(NULL, required_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS,
-            -1, 0);
-        if (out == (void*) -1) {
-            return nullptr;
+bool in_heap(void* p){
+    return is_initialized && (char*)p >= heap_base && (char*)p < heap_base + (size_t)MAX_HEAP_BLOCKS * BLOCK_SIZE;
+}
+
+// The slab p points into, or nullptr if p is not a slot. Slots never start
+// on a slab boundary, and an aligned payload there has no header to look at.
+Slab* slab_of(void* p){
+    if (!in_heap(p) || (uintptr_t)p % block_size(SLAB_ORDER) == 0) return nullptr;
+    auto* block = (MallocMetadata*)((uintptr_t)p & ~(block_size(SLAB_ORDER) - 1));
+    return block->is_slab ? (Slab*)(block + 1) : nullptr;
+}
+
+void push_slab(int slab_class, Slab* slab){
+    slab->prev = nullptr;
+    slab->next = partial_slabs[slab_class];
+    if (partial_slabs[slab_class] != nullptr) {
+        partial_slabs[slab_class]->prev = slab;
+    }
+    partial_slabs[slab_class] = slab;
+}
+
+void unlink_slab(int slab_class, Slab* slab){
+    if (slab->prev == nullptr) {
+        partial_slabs[slab_class] = slab->next;
+    } else {
+        slab->prev->next = slab->next;
+    }
+    if (slab->next != nullptr) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+uint64_t all_slots(Slab* slab){
+    return slab->slot_count == 64 ? ~uint64_t(0) : (uint64_t(1) << slab->slot_count) - 1;
+}
+
+// An empty slab of the class, not on any list yet. Caller holds the class lock.
+Slab* new_slab(int slab_class){
+    ensure_initialized();
+    MallocMetadata* block = buddy_alloc(SLAB_ORDER);
+    if (block == nullptr) return nullptr;
+    block->is_slab = true;
+    auto* slab = (Slab*)(block + 1);
+    slab->slot_size = (slab_class + 1) * 16;
+    slab->slot_count = (block_size(SLAB_ORDER) - sizeof(MallocMetadata) - sizeof(Slab)) / slab->slot_size;
+    slab->free_slots.store(all_slots(slab), std::memory_order_relaxed);
+    slab->owned = false;
+    slab_count[slab_class]++;
+    return slab;
+}
+
+// Fills out with up to n slots of the size's class under a single lock
+size_t slab_alloc_batch(size_t size, size_t n, void** out){
+    int slab_class = (size - 1) / 16;
+    std::lock_guard<std::mutex> guard(slab_locks[slab_class]);
+    size_t done = 0;
+    while (done < n) {
+        Slab* slab = partial_slabs[slab_class];
+        if (slab == nullptr) {
+            slab = new_slab(slab_class);
+            if (slab == nullptr) break;
+            push_slab(slab_class, slab);
         }
-        auto* meta = (MallocMetadata*) out;
-        meta->size = required_size;
-        meta->is_free = false;
 
-        // add to list of allocated
-        meta->prev = nullptr;
-        meta->next = mmap_list;
+        uint64_t free_slots = slab->free_slots.load(std::memory_order_relaxed);
+        while (done < n && free_slots != 0) {
+            int slot = __builtin_ctzll(free_slots);
+            free_slots &= ~(uint64_t(1) << slot);
+            out[done++] = (char*)(slab + 1) + slot * slab->slot_size;
+        }
+        slab->free_slots.store(free_slots, std::memory_order_relaxed);
+        if (free_slots == 0) {
+            unlink_slab(slab_class, slab);
+        }
+    }
+    return done;
+}
+
+void* slab_alloc(size_t size){
+    void* out;
+    return slab_alloc_batch(size, 1, &out) == 1 ? out : nullptr;
+}
+
+// An empty slab goes back to the buddy heap, unless it is the last one of
+// its class: a single object allocated and freed in a loop would otherwise
+// split and merge a buddy block every time. Caller holds the class lock and
+// passes the returned block, if any, to release_slab() after unlocking.
+MallocMetadata* return_slots(int slab_class, Slab* slab, uint64_t bits){
+    uint64_t free_slots = slab->free_slots.load(std::memory_order_relaxed);
+    bits &= ~free_slots; // Double free protection
+    if (bits == 0) return nullptr;
+    slab->free_slots.store(free_slots | bits, std::memory_order_relaxed);
+    if (slab->owned) return nullptr; // the owner collects them
+    if (free_slots == 0) {
+        push_slab(slab_class, slab);
+    }
+    free_slots |= bits;
+    if (free_slots != all_slots(slab) || slab_count[slab_class] == 1) return nullptr;
+    unlink_slab(slab_class, slab);
+    slab_count[slab_class]--;
+    auto* empty = (MallocMetadata*)slab - 1;
+    empty->is_slab = false;
+    return empty;
+}
+
+void release_slab(MallocMetadata* empty){
+    if (empty != nullptr) {
+        buddy_free(empty, SLAB_ORDER);
+        maybe_trim();
+    }
+}
+
+uint64_t slot_bit(Slab* slab, void* p){
+    size_t offset = (char*)p - (char*)(slab + 1);
+    if (offset % slab->slot_size != 0) return 0; // not the start of a slot
+    return uint64_t(1) << (offset / slab->slot_size);
+}
+
+// Frees several slots of one slab under a single lock
+void slab_free_slots(Slab* slab, void** slots, size_t count){
+    uint64_t bits = 0;
+    for (size_t i = 0; i < count; ++i) {
+        bits |= slot_bit(slab, slots[i]);
+    }
+    int slab_class = slab->slot_size / 16 - 1;
+    MallocMetadata* empty;
+    {
+        std::lock_guard<std::mutex> guard(slab_locks[slab_class]);
+        empty = return_slots(slab_class, slab, bits);
+    }
+    release_slab(empty);
+}
+
+void slab_free(Slab* slab, void* p){
+    slab_free_slots(slab, &p, 1);
+}
+
+// Refills the thread's slab of the class with the slots other threads freed
+// into it, or, once it is full, swaps it for a partial or new slab.
+bool slab_own(int slab_class){
+    std::lock_guard<std::mutex> guard(slab_locks[slab_class]);
+    Slab* slab = tcache.slabs[slab_class];
+    if (slab != nullptr && slab->free_slots.load(std::memory_order_relaxed) == 0) {
+        slab->owned = false; // full, so it stays off the partial list
+        slab = nullptr;
+    }
+    if (slab == nullptr) {
+        slab = partial_slabs[slab_class];
+        if (slab != nullptr) {
+            unlink_slab(slab_class, slab);
+        } else {
+            slab = new_slab(slab_class);
+        }
+        tcache.slabs[slab_class] = slab;
+        if (slab == nullptr) return false;
+        slab->owned = true;
+    }
+    tcache.slab_slots[slab_class] = slab->free_slots.load(std::memory_order_relaxed);
+    slab->free_slots.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+void* slab_alloc_owned(size_t size){
+    int slab_class = (size - 1) / 16;
+    if (tcache.slab_slots[slab_class] == 0 && !slab_own(slab_class)) return nullptr;
+    Slab* slab = tcache.slabs[slab_class];
+    int slot = __builtin_ctzll(tcache.slab_slots[slab_class]);
+    tcache.slab_slots[slab_class] &= ~(uint64_t(1) << slot);
+    return (char*)(slab + 1) + slot * slab->slot_size;
+}
+
+void flush_pending(int slab_class){
+    Slab* slab = tcache.pending[slab_class];
+    if (slab == nullptr) return;
+    MallocMetadata* empty;
+    {
+        std::lock_guard<std::mutex> guard(slab_locks[slab_class]);
+        empty = return_slots(slab_class, slab, tcache.pending_slots[slab_class]);
+    }
+    tcache.pending[slab_class] = nullptr;
+    tcache.pending_slots[slab_class] = 0;
+    release_slab(empty);
+}
+
+// With threads, a slot of the thread's own slab goes straight back to the
+// thread cache. Slots of other slabs gather until a slot of a different slab
+// comes, so frees in allocation order lock each slab once, and go back as
+// soon as they would empty their slab so that it can be released.
+void free_slot(Slab* slab, void* p){
+    if (!tcache_enabled()) {
+        slab_free(slab, p);
+        return;
+    }
+    uint64_t bit = slot_bit(slab, p);
+    uint64_t free_slots = slab->free_slots.load(std::memory_order_relaxed);
+    if (bit == 0 || (free_slots & bit) != 0) return; // Double free protection
+    int slab_class = slab->slot_size / 16 - 1;
+    if (slab == tcache.slabs[slab_class]) {
+        tcache.slab_slots[slab_class] |= bit;
+        return;
+    }
+    if (slab != tcache.pending[slab_class]) {
+        flush_pending(slab_class);
+        tcache.pending[slab_class] = slab;
+    }
+    tcache.pending_slots[slab_class] |= bit;
+    if ((free_slots | tcache.pending_slots[slab_class]) == all_slots(slab)) {
+        flush_pending(slab_class);
+    }
+}
+
+// Gives up the thread's slab of the class, with its free slots
+void slab_disown(int slab_class){
+    Slab* slab = tcache.slabs[slab_class];
+    if (slab == nullptr) return;
+    MallocMetadata* empty;
+    {
+        std::lock_guard<std::mutex> guard(slab_locks[slab_class]);
+        uint64_t bits = slab->free_slots.load(std::memory_order_relaxed) | tcache.slab_slots[slab_class];
+        slab->owned = false;
+        slab->free_slots.store(0, std::memory_order_relaxed); // now a full slab getting bits back
+        empty = return_slots(slab_class, slab, bits);
+    }
+    tcache.slabs[slab_class] = nullptr;
+    tcache.slab_slots[slab_class] = 0;
+    release_slab(empty);
+}
+
+ThreadCache::~ThreadCache(){
+    for (int order = 0; order <= TCACHE_MAX_ORDER; ++order) {
+        tcache_flush(order, counts[order]);
+    }
+    for (int slab_class = 0; slab_class < SLAB_CLASSES; ++slab_class) {
+        flush_pending(slab_class);
+        slab_disown(slab_class);
+    }
+}
+
+// Mapping length for a large block: whole pages, in four size classes per
+// doubling below HUGE_PAGE_SIZE and multiples of it above. Freed regions then
+// fit later requests of the same class, and srealloc grows into the slack.
+size_t mmap_length(size_t length){
+    size_t step = HUGE_PAGE_SIZE;
+    if (length < HUGE_PAGE_SIZE) {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        step = (size_t)1 << (63 - __builtin_clzll(length) - 2);
+        if (step < page) step = page;
+    }
+    return (length + step - 1) / step * step;
+}
+
+// Maps length bytes for a large block, or returns nullptr
+void* map_region(size_t length){
+    const int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (!HUGE_PAGES || length % HUGE_PAGE_SIZE != 0) {
+        void* out = mmap(NULL, length, prot, flags, -1, 0);
+        return out == MAP_FAILED ? nullptr : out;
+    }
+
+    if (!hugetlb_failed) {
+        void* out = mmap(NULL, length, prot, flags | MAP_HUGETLB, -1, 0);
+        if (out != MAP_FAILED) return out;
+        hugetlb_failed = true; // no reserved huge pages, use THP from now on
+    }
+    void* out = mmap(NULL, length + HUGE_PAGE_SIZE, prot, flags, -1, 0);
+    if (out == MAP_FAILED) return nullptr;
+    size_t padding = (HUGE_PAGE_SIZE - (uintptr_t)out % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+    if (padding != 0) {
+        munmap(out, padding);
+    }
+    munmap((char*)out + padding + length, HUGE_PAGE_SIZE - padding);
+    out = (char*)out + padding;
+    madvise(out, length, MADV_HUGEPAGE);
+    return out;
+}
+
+// A cached mapping of at least length bytes, or nullptr. The mapping's real
+// length is returned through length.
+void* cache_take(size_t& length){
+    if (MMAP_CACHE_MAX_BYTES == 0 || MMAP_CACHE_DECAY_MS == 0) return nullptr;
+    CachedRegion* found = nullptr;
+    CachedRegion* dead;
+    {
+        std::lock_guard<std::mutex> guard(mmap_lock);
+        dead = cache_expire(MMAP_CACHE_DECAY_MS, nullptr);
+        for (CachedRegion* r = cache_heads[cache_bucket(length)]; r != nullptr; r = r->next) {
+            if (r->length >= length) {
+                found = r;
+                break;
+            }
+        }
+        if (found != nullptr) {
+            cache_unlink(found);
+            length = found->length;
+            mmap_cache_hits++;
+        } else {
+            mmap_cache_misses++;
+        }
+    }
+    unmap_regions(dead);
+    return found;
+}
+
+// Keeps a freed mapping for reuse, evicting the oldest regions to stay under
+// the cap. Returns false if the caller should unmap it instead.
+bool cache_put(void* start, size_t length){
+    if (MMAP_CACHE_DECAY_MS == 0 || length > MMAP_CACHE_MAX_BYTES / 4) return false;
+    CachedRegion* dead;
+    {
+        std::lock_guard<std::mutex> guard(mmap_lock);
+        dead = cache_expire(MMAP_CACHE_DECAY_MS, nullptr);
+        while (mmap_cache_bytes + length > MMAP_CACHE_MAX_BYTES) {
+            CachedRegion* oldest = nullptr;
+            for (int b = 0; b < MMAP_CACHE_BUCKETS; ++b) {
+                if (cache_tails[b] != nullptr && (oldest == nullptr || cache_tails[b]->cached_at < oldest->cached_at)) {
+                    oldest = cache_tails[b];
+                }
+            }
+            cache_unlink(oldest);
+            oldest->next = dead;
+            dead = oldest;
+        }
+
+        auto* region = (CachedRegion*)start;
+        int bucket = cache_bucket(length);
+        region->length = length;
+        region->cached_at = now_ms();
+        region->prev = nullptr;
+        region->next = cache_heads[bucket];
+        if (cache_heads[bucket] != nullptr) {
+            cache_heads[bucket]->prev = region;
+        } else {
+            cache_tails[bucket] = region;
+        }
+        cache_heads[bucket] = region;
+        mmap_cache_bytes += length;
+    }
+    unmap_regions(dead);
+    return true;
+}
+
+// A payload that does not start right after its block's header gets a second
+// header in front of it, with is_aligned set. Its size is the distance back
+// to the real header, its order the order of a headerless buddy block that
+// starts at the payload (-1 if there is none).
+void* place_aligned(MallocMetadata* real, char* payload, int order){
+    auto* meta = (MallocMetadata*)payload - 1;
+    meta->size = (char*)meta - (char*)real;
+    meta->order = order;
+    meta->is_free = false;
+    meta->is_cached = false;
+    meta->is_zero = false;
+    meta->is_slab = false;
+    meta->is_aligned = true;
+    return payload;
+}
+
+// Maps a large block. With an alignment above 16 the payload moves up to the
+// first aligned address, the mapping being long enough for any start.
+void* mmap_alloc(size_t size, size_t alignment){
+    const size_t offset = sizeof(MmapHeader) + sizeof(MallocMetadata);
+    bool aligned = alignment > alignof(MallocMetadata);
+    void* out = nullptr;
+    size_t map_size = mmap_length(offset + size + (aligned ? alignment : 0));
+    bool is_zero = false;
+    out = cache_take(map_size);
+    if (out == nullptr) {
+        out = map_region(map_size);
+        if (out == nullptr) {
+            return nullptr;
+        }
+        is_zero = true;
+    }
+    auto* region = (MmapHeader*) out;
+    auto* meta = (MallocMetadata*)(region + 1);
+    meta->size = map_size;
+    meta->order = MMAP_ORDER;
+    meta->is_free = false;
+    meta->is_cached = false;
+    meta->is_zero = is_zero;
+    meta->is_aligned = false;
+
+    // add to list of allocated
+    {
+        std::lock_guard<std::mutex> guard(mmap_lock);
+        region->prev = nullptr;
+        region->next = mmap_list;
         if (mmap_list !=nullptr) {
-            mmap_list->prev= meta;
+            mmap_list->prev= region;
         }
-        mmap_list = meta;
+        mmap_list = region;
+    }
 
-        allocated_blocks++;
-        allocated_bytes += size;
+    allocated_blocks++;
+    allocated_bytes += payload_size(meta); // a cached mapping may be larger than asked for
+    mmap_blocks++;
 
-        return (void*)(meta + 1);
+    char* payload = (char*)(meta + 1);
+    if (aligned && (uintptr_t)payload % alignment != 0) {
+        payload = (char*)(((uintptr_t)payload + alignment - 1) & ~(alignment - 1));
+        return place_aligned(meta, payload, -1);
     }
+    return payload;
+}
 
-    //small block
-    int current_power = power;
-    while (current_power <= MAX_ORDER && free_lists[current_power] == nullptr) {
-        current_power++;
+// An aligned block of order `order` (at least SLAB_ORDER) that needs no
+// header of its own: take a block twice that size, keep its upper half for
+// the payload and the last granule of its lower half for the headers, and
+// return everything else to the free lists.
+void* aligned_split_alloc(int order){
+    ensure_initialized();
+    MallocMetadata* outer = buddy_alloc(order + 1);
+    if (outer == nullptr) return nullptr;
+    bool is_zero = outer->is_zero;
+    char* payload = (char*)outer + block_size(order);
+
+    for (int i = order - 1; i >= 0; --i) {
+        auto* piece = (MallocMetadata*)(payload - 2 * block_size(i));
+        piece->is_cached = false;
+        piece->is_zero = is_zero;
+        piece->is_slab = false;
+        piece->is_aligned = false;
+        std::lock_guard<std::mutex> guard(order_locks[i]);
+        insert(i, piece);
     }
+    allocated_blocks += order + 1;
+    allocated_bytes -= (order + 1) * sizeof(MallocMetadata);
+
+    auto* granule = (MallocMetadata*)(payload - block_size(0));
+    granule->order = 0;
+    granule->is_free = false;
+    granule->is_cached = false;
+    granule->is_zero = false;
+    granule->is_slab = false;
+    granule->is_aligned = false;
+    return place_aligned(granule, payload, order);
+}
 
-    if (current_power > MAX_ORDER) return nullptr;
+// Frees the headerless block of an aligned payload, if it has one, and
+// returns the header of the block that holds the payload's headers.
+MallocMetadata* aligned_release(MallocMetadata* meta){
+    auto* real = (MallocMetadata*)((char*)meta - meta->size);
+    if (real->is_free || real->is_cached) return real; // Double free, the caller bails out
+    if (meta->order >= 0) {
+        auto* block = (MallocMetadata*)(meta + 1);
+        block->order = meta->order;
+        block->is_free = false;
+        block->is_cached = false;
+        block->is_zero = false;
+        block->is_slab = false;
+        block->is_aligned = false;
+        buddy_free(block, meta->order);
+    }
+    return real;
+}
 
+// Bytes from an aligned payload to the end of its block
+size_t aligned_usable_size(MallocMetadata* meta){
+    if (meta->order >= 0) return block_size(meta->order);
+    auto* real = (MallocMetadata*)((char*)meta - meta->size);
+    char* end = (char*)(real + 1) + payload_size(real);
+    return end - (char*)(meta + 1);
+}
 
+void* smalloc(size_t size){
+    if (size <= 0 || size > MAX_SIZE) return nullptr;
+    size_t required_size = size + sizeof(MallocMetadata);
 
-    //the block we want to use
-    MallocMetadata* output = free_lists[current_power];
-    remove(output);
-    output->is_free = false; //TODO: remove this field entirely
+    // large block
+    if (required_size > BLOCK_SIZE ) {
+        return mmap_alloc(size, 0);
+    }
 
-    //split
-    while(current_power > power){
-        current_power--;
-        size_t new_size = output->size / 2;
+    if (size <= SLAB_MAX_SIZE) {
+        return tcache_enabled() ? slab_alloc_owned(size) : slab_alloc(size);
+    }
 
-        auto* buddy = (MallocMetadata*)((char*)output + new_size);
-        buddy->size = new_size;
-        buddy->is_free = true;
-        insert(current_power, buddy);
+    int power = find_order(required_size);
 
-        output->size = new_size;
-        allocated_blocks++;
-        allocated_bytes -= sizeof(MallocMetadata);
+    //small block, served from this thread's cache
+    if (power <= TCACHE_MAX_ORDER && tcache_enabled()) {
+        if (tcache.counts[power] == 0) {
+            tcache_refill(power);
+        }
+        if (tcache.counts[power] == 0) return nullptr;
+        return tcache_pop(power) + 1;
     }
+
+    ensure_initialized();
+    MallocMetadata* output = buddy_alloc(power);
+    if (output == nullptr) return nullptr;
     return output + 1;
 }
 
+// Zeroes n bytes at p. Large ranges drop their whole pages with
+// MADV_DONTNEED, which the kernel refills with zeros on the next touch,
+// and only the partial pages at either end are written.
+const size_t MADVISE_ZERO_MIN = BLOCK_SIZE;
+
+void zero_bytes(void* p, size_t n){
+    const size_t page = sysconf(_SC_PAGESIZE);
+    char* start = (char*)p;
+    char* end = start + n;
+    char* first_page = (char*)(((uintptr_t)start + page - 1) / page * page);
+    char* last_page = (char*)((uintptr_t)end / page * page);
+    if (n < MADVISE_ZERO_MIN || madvise(first_page, last_page - first_page, MADV_DONTNEED) != 0) {
+        memset(p, 0, n);
+        return;
+    }
+    memset(start, 0, first_page - start);
+    memset(last_page, 0, end - last_page);
+}
+
 void* scalloc(size_t num, size_t size){
     if(num<= 0 || size <=0 ||  size >= MAX_SIZE ||
        num*size>=MAX_SIZE ) {return nullptr; }
 
     void* ptr = smalloc(num*size);
     if (ptr == nullptr) {return nullptr; }
-    //set to 0's
-    memset(ptr, 0, num*size);
+    //set to 0's, unless the block never held data
+    if (slab_of(ptr) != nullptr || !((MallocMetadata*)ptr - 1)->is_zero) {
+        zero_bytes(ptr, num*size);
+    }
 
     return ptr;
 }
 
+// Frees an allocated buddy block into the thread cache or the free lists
+void free_buddy_block(MallocMetadata* meta, int order){
+    if (order <= TCACHE_MAX_ORDER && tcache_enabled()) {
+        tcache_push(order, meta);
+        if (tcache.counts[order] > TCACHE_LIMIT) {
+            tcache_flush(order, TCACHE_BATCH);
+        }
+        return;
+    }
+
+    buddy_free(meta, order);
+    maybe_trim();
+}
+
+void sized_free_error(void* p, size_t size){
+    std::cerr << "sfree_sized: " << p << " is not a block of " << size << " bytes" << std::endl;
+    abort();
+}
+
 void sfree(void* p) {
     if (p==nullptr || p<= (void*) sizeof(MallocMetadata) ) return;
+    Slab* slab = slab_of(p);
+    if (slab != nullptr) {
+        free_slot(slab, p);
+        return;
+    }
     MallocMetadata* meta = (MallocMetadata*)p - 1;
+    if (meta->is_aligned) {
+        meta = aligned_release(meta);
+    }
 
-    if (meta->size > BLOCK_SIZE) {
-        MallocMetadata* prev_elem = meta->prev;
-        MallocMetadata* next_elem = meta->next;
+    if (meta->order == MMAP_ORDER) {
+        auto* region = (MmapHeader*)meta - 1;
+        {
+            std::lock_guard<std::mutex> guard(mmap_lock);
+            MmapHeader* prev_elem = region->prev;
+            MmapHeader* next_elem = region->next;
+
+            if (prev_elem == nullptr) {
+                // region is the head, update the array
+                mmap_list = next_elem;
+            } else {
+                prev_elem->next = next_elem;
+            }
 
-        if (prev_elem == nullptr) {
-            // meta is the head, update the array
-            mmap_list = next_elem;
-        } else {
-            prev_elem->next = next_elem;
+            if(next_elem != nullptr){
+                next_elem->prev = prev_elem;
+            }
         }
 
-        if(next_elem != nullptr){
-            next_elem->prev = prev_elem;
+        allocated_blocks--;
+        allocated_bytes -= payload_size(meta);
+        mmap_blocks--;
+        size_t map_size = meta->size;
+        if (!cache_put(region, map_size)) {
+            munmap(region, map_size);
         }
 
-        meta->next = nullptr;
-        meta->prev = nullptr;
-        allocated_blocks--;
-        allocated_bytes -= (meta->size - sizeof(MallocMetadata));
-        munmap(meta, meta->size);
+        return;
+    }
 
+    if (meta->is_free || meta->is_cached) return; // Double free protection
+
+    free_buddy_block(meta, meta->order);
+}
 
+// sfree() for a block the caller knows the size of, as passed to smalloc or
+// scalloc (C++14 sized deallocation). The size picks the path, so buddy
+// blocks skip the mmap and aligned checks of sfree(). srealloc shrinks in
+// place, though, so a block that is not what the size says (not a slot, or
+// of another order) goes through sfree(). Aligned payloads must use sfree().
+// With MALLOC_DEBUG the header is checked against the size.
+void sfree_sized(void* p, size_t size) {
+    if (p == nullptr) return;
+    if (size == 0) size = 1;
+    if (size + sizeof(MallocMetadata) > BLOCK_SIZE) {
+        sfree(p);
         return;
     }
 
-    if (meta->is_free) return; // Double free protection
+    if (size <= SLAB_MAX_SIZE) {
+        Slab* slab = slab_of(p);
+        if (slab == nullptr) {
+            sfree(p);
+            return;
+        }
+        free_slot(slab, p);
+        return;
+    }
 
-    int order = find_order(meta->size);
-    meta->is_free = true;
+    MallocMetadata* meta = (MallocMetadata*)p - 1;
+    int order = find_order(size + sizeof(MallocMetadata));
+    if (MALLOC_DEBUG && (slab_of(p) != nullptr || meta->is_aligned || meta->is_free || meta->is_cached)) {
+        sized_free_error(p, size);
+    }
+    if (meta->order != order) {
+        sfree(p);
+        return;
+    }
+    free_buddy_block(meta, order);
+}
 
-    // Iterative Merge
-    while (order < MAX_ORDER) {
-        // XOR Trick to find buddy address
-        auto block_addr = (intptr_t)meta;
-        intptr_t buddy_addr = block_addr ^ meta->size;
-        auto* buddy = (MallocMetadata*)buddy_addr;
+// Moves an mmap block to the size class of its new size with mremap. With
+// MREMAP_MAYMOVE in flags the region may move, so its neighbours in
+// mmap_list are relinked under the same lock.
+void* mmap_resize(MallocMetadata* meta, size_t size, int flags){
+    size_t old_length = meta->size;
+    size_t new_length = mmap_length(sizeof(MmapHeader) + sizeof(MallocMetadata) + size);
+    if (new_length == old_length) {
+        return meta + 1; // fits the slack of the current class
+    }
 
-        // Check buddy is free and correct size
-        if (!buddy->is_free || buddy->size != meta->size) {
-            break;
-        }
+    size_t old_size = payload_size(meta);
+    std::lock_guard<std::mutex> guard(mmap_lock);
+    void* moved = mremap((MmapHeader*)meta - 1, old_length, new_length, flags);
+    if (moved == MAP_FAILED) return nullptr;
 
-        // Merge - remove buddy from free list
-        remove(buddy);
+    auto* region = (MmapHeader*)moved;
+    if (region->prev == nullptr) {
+        mmap_list = region;
+    } else {
+        region->prev->next = region;
+    }
+    if (region->next != nullptr) {
+        region->next->prev = region;
+    }
+    meta = (MallocMetadata*)(region + 1);
+    meta->size = new_length;
+    allocated_bytes += payload_size(meta);
+    allocated_bytes -= old_size;
+    return meta + 1;
+}
 
-        // Combine: The one with lower address becomes the start
-        if (buddy < meta) {
-            meta = buddy;
+// Grows an allocated buddy block in place by absorbing free buddies until it
+// holds size bytes. With allow_move, buddies below the block count too and
+// the data moves down with the block start. Returns the grown block, or
+// nullptr (leaving everything as it was) if the buddies are not free.
+MallocMetadata* merge_buddies(MallocMetadata* old_meta_ptr, size_t size, bool allow_move){
+    void* oldp = old_meta_ptr + 1;
+    // Every buddy we may absorb lives in [first_order, last_order)
+    int first_order = old_meta_ptr->order;
+    int last_order = find_order(size + sizeof(MallocMetadata));
+    for (int i = first_order; i < last_order; ++i) order_locks[i].lock();
+
+    // Check if we can obtain a large enough block by merging
+    MallocMetadata* curr = old_meta_ptr;
+    int possible_order = first_order;
+    bool can_merge = false;
+
+    // Check if enough free buddies exist to satisfy request
+    while (possible_order < MAX_ORDER && block_size(possible_order) < size + sizeof(MallocMetadata)) {
+        intptr_t buddy_addr = (intptr_t)curr ^ block_size(possible_order);
+        MallocMetadata* buddy = (MallocMetadata*)buddy_addr;
+
+        // Check if buddy is allocated or different size
+        if (!bitmap_test(possible_order, block_index(possible_order, buddy)) ||
+            (!allow_move && buddy < curr)) {
+            can_merge = false;
+            break;
         }
 
-        meta->size *= 2;
-        allocated_blocks--;
-        allocated_bytes += sizeof(MallocMetadata);
-        order++;
+        if ((MallocMetadata*)buddy_addr < curr) {
+            curr = (MallocMetadata*)buddy_addr; // Move start pointer if buddy smaller
+        }
+        possible_order++;
+        can_merge = true;
     }
 
-    // Insert the final merged block
-    insert(order, meta);
+    // If large enough, merge all and reuse
+    if (can_merge && block_size(possible_order) >= size + sizeof(MallocMetadata)) {
+        // Do merges
+        for (int order = first_order; order < possible_order; ++order) {
+            intptr_t buddy_addr = (intptr_t)old_meta_ptr ^ block_size(order);
+            auto* buddy = (MallocMetadata*)buddy_addr;
+
+            remove(order, buddy); // Remove free buddy from list
+
+            if (buddy < old_meta_ptr) {
+                old_meta_ptr = buddy; // Determine new start
+                memmove(old_meta_ptr + 1, oldp, block_size(order) - sizeof(MallocMetadata)); // Move data if address changed
+                oldp = old_meta_ptr + 1;
+            }
+
+            allocated_blocks--;
+            allocated_bytes += sizeof(MallocMetadata);
+        }
+        old_meta_ptr->order = possible_order;
+        old_meta_ptr->is_free = false;
+        for (int i = first_order; i < last_order; ++i) order_locks[i].unlock();
+        return old_meta_ptr;
+    }
+    for (int i = first_order; i < last_order; ++i) order_locks[i].unlock();
+    return nullptr;
 }
 
 void* srealloc(void* oldp, size_t size) {
     if (size <= 0 ||size >= MAX_SIZE ) return nullptr;
     if (oldp==nullptr) return smalloc(size);
 
-    MallocMetadata* old_meta_ptr = (MallocMetadata*) oldp - 1;
-
-    if (size <= old_meta_ptr->size - sizeof(MallocMetadata)) return oldp;
-
-    // Small block (not mmap)
-    if(old_meta_ptr->size <= BLOCK_SIZE){
-        // Check if we can obtain a large enough block by merging
-        size_t possible_size = old_meta_ptr->size;
-        MallocMetadata* curr = old_meta_ptr;
-        bool can_merge = false;
-
-        // Check if enough free buddies exist to satisfy request
-        while (possible_size < BLOCK_SIZE && possible_size < size + sizeof(MallocMetadata)) {
-            intptr_t buddy_addr = (intptr_t)curr ^ possible_size;
-            MallocMetadata* buddy = (MallocMetadata*)buddy_addr;
-
-            // Check if buddy is allocated or different size
-            if (!buddy->is_free || buddy->size != possible_size) {
-                can_merge = false;
-                break;
-            }
-
-            if ((MallocMetadata*)buddy_addr < curr) {
-                curr = (MallocMetadata*)buddy_addr; // Move start pointer if buddy smaller
-            }
-            possible_size *= 2;
-            can_merge = true;
-        }
+    Slab* slab = slab_of(oldp);
+    if (slab != nullptr) {
+        if (size <= slab->slot_size) return oldp;
+        void* new_ptr = smalloc(size);
+        if (new_ptr == nullptr) {return nullptr;}
+        memmove(new_ptr, oldp, slab->slot_size);
+        sfree(oldp);
+        return new_ptr;
+    }
 
-        // If large enough, merge all and reuse
-        if (can_merge && possible_size >= size + sizeof(MallocMetadata)) {
-            // Do merges
-            while (old_meta_ptr->size < possible_size) {
-                intptr_t buddy_addr = (intptr_t)old_meta_ptr ^ old_meta_ptr->size;
-                auto* buddy = (MallocMetadata*)buddy_addr;
+    MallocMetadata* old_meta_ptr = (MallocMetadata*) oldp - 1;
+    if (old_meta_ptr->is_aligned) {
+        // The new block does not have to keep the alignment
+        size_t old_size = aligned_usable_size(old_meta_ptr);
+        if (size <= old_size) return oldp;
+        void* new_ptr = smalloc(size);
+        if (new_ptr == nullptr) {return nullptr;}
+        memmove(new_ptr, oldp, old_size);
+        sfree(oldp);
+        return new_ptr;
+    }
 
-                remove(buddy); // Remove free buddy from list
+    // Large to large: let the kernel move the pages instead of copying them
+    if (old_meta_ptr->order == MMAP_ORDER && size + sizeof(MallocMetadata) > BLOCK_SIZE) {
+        void* resized = mmap_resize(old_meta_ptr, size, MREMAP_MAYMOVE);
+        if (resized != nullptr) return resized;
+        // hugetlb mappings only resize in whole huge pages, copy instead
+    }
 
-                if (buddy < old_meta_ptr) {
-                    old_meta_ptr = buddy; // Determine new start
-                    memmove(old_meta_ptr + 1, oldp, old_meta_ptr->size - sizeof(MallocMetadata)); // Move data if address changed
-                    oldp = old_meta_ptr + 1;
-                }
+    size_t old_size = payload_size(old_meta_ptr);
+    if (size <= old_size) return oldp;
 
-                old_meta_ptr->size *= 2;
-                allocated_blocks--;
-                allocated_bytes += sizeof(MallocMetadata);
-                old_meta_ptr->is_free = false;
-            }
-            return oldp;
-        }
+    // Small block (not mmap)
+    if(old_meta_ptr->order != MMAP_ORDER){
+        MallocMetadata* merged = merge_buddies(old_meta_ptr, size, true);
+        if (merged != nullptr) return merged + 1;
     }
 
     // Allocate new if we can't merge
     void* new_ptr = smalloc(size);
     if (new_ptr == nullptr) {return nullptr;}
 
-    memmove (new_ptr,oldp,old_meta_ptr->size - sizeof(MallocMetadata));
+    memmove (new_ptr,oldp,old_size);
     sfree(oldp);
     return new_ptr;
 }
@@ -332,9 +1427,311 @@ size_t _num_allocated_bytes() {
 
 }
 size_t _num_meta_data_bytes() {
-    return (sizeof (MallocMetadata) * allocated_blocks);
+    return (sizeof (MallocMetadata) * allocated_blocks) + sizeof(MmapHeader) * mmap_blocks;
 
 }
 size_t _size_meta_data() {
     return sizeof (MallocMetadata);
 }
+
+// Releases the pages of every fully free root block and every cached mmap
+// region right away
+size_t _strim() {
+    CachedRegion* dead;
+    {
+        std::lock_guard<std::mutex> guard(mmap_lock);
+        dead = cache_expire(0, nullptr);
+    }
+    size_t released = unmap_regions(dead);
+    if (!is_initialized) return released;
+    return released + trim_free_roots(0);
+}
+
+// Buddy heap bytes backed by usable (read/write) mappings
+size_t _num_committed_bytes() {
+    return (size_t)heap_blocks * BLOCK_SIZE;
+}
+
+// Buddy heap bytes currently in RAM
+size_t _num_resident_bytes() {
+    if (!is_initialized) return 0;
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t chunk = BLOCK_SIZE * 32;
+    unsigned char pages[chunk / 4096]; // one entry per page, pages are at least 4 KB
+    size_t committed = _num_committed_bytes();
+    size_t resident = 0;
+    for (size_t offset = 0; offset < committed; offset += chunk) {
+        size_t length = committed - offset < chunk ? committed - offset : chunk;
+        if (mincore(heap_base + offset, length, pages) != 0) continue;
+        for (size_t i = 0; i < length / page; ++i) {
+            resident += (pages[i] & 1) * page;
+        }
+    }
+    return resident;
+}
+
+// Cuts the first count blocks of the given order out of a block taken off the
+// free lists, handing the rest back as the largest aligned blocks that fit.
+// The statistics change once for the whole block.
+void carve_blocks(MallocMetadata* outer, int outer_order, int order, size_t count, void** out){
+    bool is_zero = outer->is_zero;
+    char* start = (char*)outer;
+    for (size_t i = 0; i < count; ++i) {
+        auto* meta = (MallocMetadata*)(start + i * block_size(order));
+        meta->order = order;
+        meta->is_free = false;
+        meta->is_cached = false;
+        meta->is_zero = is_zero;
+        meta->is_slab = false;
+        meta->is_aligned = false;
+        out[i] = meta + 1;
+    }
+
+    char* rest = start + count * block_size(order);
+    char* end = start + block_size(outer_order);
+    size_t pieces = 0;
+    while (rest < end) {
+        int piece_order = __builtin_ctzll((uintptr_t)(rest - heap_base)) - 7;
+        while (rest + block_size(piece_order) > end) piece_order--;
+        auto* piece = (MallocMetadata*)rest;
+        piece->is_cached = false;
+        piece->is_zero = is_zero;
+        piece->is_slab = false;
+        piece->is_aligned = false;
+        {
+            std::lock_guard<std::mutex> guard(order_locks[piece_order]);
+            insert(piece_order, piece);
+        }
+        rest += block_size(piece_order);
+        pieces++;
+    }
+    allocated_blocks += count + pieces - 1;
+    allocated_bytes -= (count + pieces - 1) * sizeof(MallocMetadata);
+}
+
+// Allocates up to n blocks of size bytes into out and returns how many it
+// got. Buddy blocks are cut from one block large enough for the whole batch
+// (up to a root block at a time) instead of being split one by one.
+size_t smalloc_batch(size_t size, size_t n, void** out) {
+    if (size <= 0 || size > MAX_SIZE) return 0;
+    if (size <= SLAB_MAX_SIZE) return slab_alloc_batch(size, n, out);
+
+    size_t done = 0;
+    size_t required_size = size + sizeof(MallocMetadata);
+    if (required_size > BLOCK_SIZE) {
+        while (done < n && (out[done] = smalloc(size)) != nullptr) done++;
+        return done;
+    }
+
+    ensure_initialized();
+    int order = find_order(required_size);
+    while (done < n) {
+        size_t want = n - done;
+        int outer_order = order + (want == 1 ? 0 : 64 - __builtin_clzll(want - 1));
+        if (outer_order > MAX_ORDER) outer_order = MAX_ORDER;
+        MallocMetadata* outer = buddy_alloc(outer_order);
+        if (outer == nullptr && outer_order > order) {
+            outer_order = order; // no room for a big block, go one at a time
+            outer = buddy_alloc(order);
+        }
+        if (outer == nullptr) break;
+        size_t count = (size_t)1 << (outer_order - order);
+        if (count > want) count = want;
+        carve_blocks(outer, outer_order, order, count, out + done);
+        done += count;
+    }
+    return done;
+}
+
+// Frees n pointers at once. ptrs is sorted in place, so buddies freed in the
+// same batch merge with each other right here, without locks, and only the
+// merged blocks go through buddy_free().
+void sfree_batch(void** ptrs, size_t n) {
+    std::sort(ptrs, ptrs + n);
+    size_t merged = 0;
+    size_t pending = 0; // ptrs[0, pending) is reused as a stack of block headers
+    void* previous = nullptr;
+    for (size_t i = 0; i < n; ++i) {
+        void* p = ptrs[i];
+        if (p == previous) continue; // Double free within the batch
+        previous = p;
+        if (p == nullptr || p <= (void*) sizeof(MallocMetadata)) continue;
+
+        Slab* slab = slab_of(p);
+        if (slab != nullptr) {
+            // The sort put the slots of a slab next to each other
+            size_t end = i + 1;
+            while (end < n && (char*)ptrs[end] < (char*)slab - sizeof(MallocMetadata) + block_size(SLAB_ORDER)) end++;
+            slab_free_slots(slab, ptrs + i, end - i);
+            previous = ptrs[end - 1];
+            i = end - 1;
+            continue;
+        }
+        MallocMetadata* meta = (MallocMetadata*)p - 1;
+        if (meta->is_aligned || meta->order == MMAP_ORDER) {
+            sfree(p);
+            continue;
+        }
+        if (meta->is_free || meta->is_cached) continue; // Double free protection
+
+        while (pending > 0 && meta->order < MAX_ORDER) {
+            auto* last = (MallocMetadata*)ptrs[pending - 1];
+            if (last->order != meta->order || ((uintptr_t)last ^ block_size(meta->order)) != (uintptr_t)meta) break;
+            last->order++;
+            meta = last;
+            pending--;
+            merged++;
+        }
+        ptrs[pending++] = meta;
+    }
+    allocated_blocks -= merged;
+    allocated_bytes += merged * sizeof(MallocMetadata);
+
+    for (size_t i = 0; i < pending; ++i) {
+        auto* meta = (MallocMetadata*)ptrs[i];
+        buddy_free(meta, meta->order);
+    }
+    maybe_trim();
+}
+
+// Bytes the caller may use at p, at least what was asked for
+size_t smalloc_usable_size(void* p) {
+    if (p == nullptr) return 0;
+    Slab* slab = slab_of(p);
+    if (slab != nullptr) return slab->slot_size;
+    auto* meta = (MallocMetadata*)p - 1;
+    if (meta->is_aligned) return aligned_usable_size(meta);
+    return payload_size(meta);
+}
+
+// Grows the block at p to hold new_size bytes without moving it: slack in the
+// block, free buddies above it, or mremap without MREMAP_MAYMOVE. Returns
+// false, with the block untouched, when that is not possible.
+bool sexpand(void* p, size_t new_size) {
+    if (p == nullptr || new_size <= 0 || new_size >= MAX_SIZE) return false;
+    if (new_size <= smalloc_usable_size(p)) return true;
+    if (slab_of(p) != nullptr) return false;
+
+    auto* meta = (MallocMetadata*)p - 1;
+    if (meta->is_aligned) return false;
+    if (meta->order == MMAP_ORDER) {
+        return mmap_resize(meta, new_size, 0) != nullptr;
+    }
+    return merge_buddies(meta, new_size, false) != nullptr;
+}
+
+// Payloads aligned to any power of two. Up to 16 bytes that is every block;
+// aligned spans from SLAB_ORDER up to half a root block use
+// aligned_split_alloc(), smaller ones the first aligned address in a block
+// of alignment + size bytes, and anything larger goes to mmap.
+void* saligned_alloc(size_t alignment, size_t size) {
+    if (size <= 0 || size > MAX_SIZE) return nullptr;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return nullptr;
+    // Keeps the mapping within the 32-bit size field and the cache buckets
+    if (alignment > MAX_SIZE) return nullptr;
+    if (alignment <= alignof(MallocMetadata)) return smalloc(size);
+
+    size_t span = alignment > size ? alignment : size;
+    if (span <= block_size(SLAB_ORDER - 1)) {
+        ensure_initialized();
+        MallocMetadata* block = buddy_alloc(find_order(alignment + size));
+        if (block == nullptr) return nullptr;
+        return place_aligned(block, (char*)block + alignment, -1);
+    }
+    if (span <= block_size(MAX_ORDER - 1)) {
+        return aligned_split_alloc(find_order(span));
+    }
+    return mmap_alloc(size, alignment);
+}
+
+int sposix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+    void* p = saligned_alloc(alignment, size);
+    if (p == nullptr) return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+size_t _num_mmap_cache_hits() {
+    return mmap_cache_hits;
+}
+size_t _num_mmap_cache_misses() {
+    return mmap_cache_misses;
+}
+// Bytes of freed mmap regions held for reuse
+size_t _num_mmap_cache_bytes() {
+    return mmap_cache_bytes;
+}
+
+// Opt-in: route the global operator new/delete family through this allocator,
+// with the sized deletes going to sfree_sized()
+#ifndef REPLACE_OPERATOR_NEW
+#define REPLACE_OPERATOR_NEW 0
+#endif
+#if REPLACE_OPERATOR_NEW
+void* operator new(size_t size) {
+    void* p = smalloc(size == 0 ? 1 : size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return smalloc(size == 0 ? 1 : size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return smalloc(size == 0 ? 1 : size);
+}
+void* operator new(size_t size, std::align_val_t alignment) {
+    void* p = saligned_alloc((size_t)alignment, size == 0 ? 1 : size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return saligned_alloc((size_t)alignment, size == 0 ? 1 : size);
+}
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return saligned_alloc((size_t)alignment, size == 0 ? 1 : size);
+}
+
+void operator delete(void* p) noexcept {
+    sfree(p);
+}
+void operator delete[](void* p) noexcept {
+    sfree(p);
+}
+void operator delete(void* p, size_t size) noexcept {
+    sfree_sized(p, size);
+}
+void operator delete[](void* p, size_t size) noexcept {
+    sfree_sized(p, size);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    sfree(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    sfree(p);
+}
+void operator delete(void* p, std::align_val_t) noexcept {
+    sfree(p);
+}
+void operator delete[](void* p, std::align_val_t) noexcept {
+    sfree(p);
+}
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    sfree(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+    sfree(p);
+}
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    sfree(p);
+}
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    sfree(p);
+}
+#endif
@@ -0,0 +1,316 @@
+// Buddy allocator with out-of-band metadata
+#include <iostream>
+#include <unistd.h>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <mutex>
+
+// Same heap shape as malloc_3, but buddy blocks carry no header: whether a
+// block is split or free lives in a bitmap per root block, and the order of
+// an allocated block is looked up in a page map. A power-of-two request
+// therefore fits its order exactly, and payloads are naturally aligned to
+// their block size.
+
+const int MAX_SIZE = 100000000;
+const int MAX_ORDER = 10;
+const size_t MIN_BLOCK = 128;
+const size_t BLOCK_SIZE = MIN_BLOCK << MAX_ORDER;
+const int HEAP_BLOCKS = 32;
+const int GRANULES = BLOCK_SIZE / MIN_BLOCK;
+const uint8_t NO_BLOCK = 0xff;
+bool is_initialized = false;
+char* heap_base = nullptr;
+
+std::mutex heap_lock;
+
+size_t free_blocks = 0;
+size_t free_bytes = 0;
+size_t allocated_blocks = 0;
+size_t allocated_bytes = 0;
+size_t mmap_blocks = 0;
+
+// Bookkeeping for one 128 KB root block. Node 1 is the whole root, nodes
+// 2i and 2i+1 are the halves of node i, so the blocks of order k are nodes
+// [2^(MAX_ORDER-k), 2^(MAX_ORDER-k+1)).
+struct RootInfo {
+    uint64_t free_nodes[2 * GRANULES / 64] = {0};
+    uint8_t orders[GRANULES]; // order of the allocated block starting at each granule
+};
+RootInfo roots[HEAP_BLOCKS];
+
+// Free blocks link through their own first bytes
+struct FreeBlock {
+    FreeBlock* next;
+    FreeBlock* prev;
+};
+FreeBlock* free_lists[MAX_ORDER + 1] = {nullptr};
+uint64_t nonempty_orders = 0;
+
+// Only mmap blocks have an in-band header
+struct MmapMetadata {
+    size_t size = 0; // length of the mapping
+    size_t pad = 0;  // keeps the payload 16-byte aligned
+};
+
+size_t block_size(int order){
+    return MIN_BLOCK << order;
+}
+
+int find_order(size_t size){
+    if (size <= MIN_BLOCK) return 0;
+    return 64 - __builtin_clzll(size - 1) - 7;
+}
+
+bool in_heap(void* p){
+    return heap_base != nullptr && (char*)p >= heap_base && (char*)p < heap_base + HEAP_BLOCKS * BLOCK_SIZE;
+}
+
+RootInfo& root_of(void* p){
+    return roots[((char*)p - heap_base) / BLOCK_SIZE];
+}
+
+size_t granule_of(void* p){
+    return (((char*)p - heap_base) % BLOCK_SIZE) / MIN_BLOCK;
+}
+
+size_t node_of(int order, void* p){
+    return ((size_t)1 << (MAX_ORDER - order)) + (((char*)p - heap_base) % BLOCK_SIZE) / block_size(order);
+}
+
+bool is_free_node(int order, void* p){
+    size_t node = node_of(order, p);
+    return (root_of(p).free_nodes[node / 64] >> (node % 64)) & 1;
+}
+
+void insert(int order, void* p){
+    size_t node = node_of(order, p);
+    root_of(p).free_nodes[node / 64] |= uint64_t(1) << (node % 64);
+
+    auto* block = (FreeBlock*)p;
+    block->prev = nullptr;
+    block->next = free_lists[order];
+    if (free_lists[order] != nullptr) {
+        free_lists[order]->prev = block;
+    }
+    free_lists[order] = block;
+    nonempty_orders |= uint64_t(1) << order;
+
+    free_blocks++;
+    free_bytes += block_size(order);
+}
+
+void remove(int order, void* p){
+    size_t node = node_of(order, p);
+    root_of(p).free_nodes[node / 64] &= ~(uint64_t(1) << (node % 64));
+
+    auto* block = (FreeBlock*)p;
+    if (block->prev == nullptr) {
+        free_lists[order] = block->next;
+        if (block->next == nullptr) {
+            nonempty_orders &= ~(uint64_t(1) << order);
+        }
+    } else {
+        block->prev->next = block->next;
+    }
+    if (block->next != nullptr) {
+        block->next->prev = block->prev;
+    }
+
+    free_blocks--;
+    free_bytes -= block_size(order);
+}
+
+void init(){
+    size_t total_size = HEAP_BLOCKS * BLOCK_SIZE;
+    intptr_t current_brk = (intptr_t)sbrk(0);
+    size_t padding = 0;
+
+    if (current_brk % total_size != 0) {
+        padding = total_size - (current_brk % total_size);
+    }
+    void* ptr = sbrk(padding + total_size);
+    if(ptr == (void*)-1) return;
+    heap_base = (char*)ptr + padding;
+
+    for (int i = 0; i < HEAP_BLOCKS; ++i) {
+        memset(roots[i].orders, NO_BLOCK, GRANULES);
+        allocated_blocks++;
+        allocated_bytes += BLOCK_SIZE;
+        insert(MAX_ORDER, heap_base + i * BLOCK_SIZE);
+    }
+    is_initialized = true;
+}
+
+char* buddy_alloc(int power){
+    uint64_t candidates = nonempty_orders & (~uint64_t(0) << power);
+    if (candidates == 0) return nullptr;
+    int current_power = __builtin_ctzll(candidates);
+
+    auto* output = (char*)free_lists[current_power];
+    remove(current_power, output);
+
+    //split
+    while (current_power > power) {
+        current_power--;
+        insert(current_power, output + block_size(current_power));
+        allocated_blocks++;
+    }
+    root_of(output).orders[granule_of(output)] = power;
+    return output;
+}
+
+void buddy_free(char* block, int order){
+    root_of(block).orders[granule_of(block)] = NO_BLOCK;
+
+    while (order < MAX_ORDER) {
+        // XOR Trick to find buddy address
+        char* buddy = heap_base + (((size_t)(block - heap_base)) ^ block_size(order));
+        if (!is_free_node(order, buddy)) break;
+
+        remove(order, buddy);
+        if (buddy < block) {
+            block = buddy;
+        }
+        allocated_blocks--;
+        order++;
+    }
+    insert(order, block);
+}
+
+void* smalloc(size_t size){
+    if (size <= 0 || size > MAX_SIZE) return nullptr;
+
+    // large block
+    if (size > BLOCK_SIZE) {
+        size_t map_size = sizeof(MmapMetadata) + size;
+        void* out = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (out == MAP_FAILED) {
+            return nullptr;
+        }
+        auto* meta = (MmapMetadata*)out;
+        meta->size = map_size;
+
+        std::lock_guard<std::mutex> guard(heap_lock);
+        mmap_blocks++;
+        allocated_blocks++;
+        allocated_bytes += size;
+        return meta + 1;
+    }
+
+    std::lock_guard<std::mutex> guard(heap_lock);
+    if (!is_initialized) {
+        init();
+    }
+    return buddy_alloc(find_order(size));
+}
+
+void* scalloc(size_t num, size_t size){
+    if(num<= 0 || size <=0 ||  size >= MAX_SIZE ||
+       num*size>=MAX_SIZE ) {return nullptr; }
+
+    void* ptr = smalloc(num*size);
+    if (ptr == nullptr) {return nullptr; }
+    //set to 0's
+    memset(ptr, 0, num*size);
+
+    return ptr;
+}
+
+void sfree(void* p) {
+    if (p == nullptr) return;
+
+    std::unique_lock<std::mutex> guard(heap_lock);
+    if (!in_heap(p)) {
+        auto* meta = (MmapMetadata*)p - 1;
+        mmap_blocks--;
+        allocated_blocks--;
+        allocated_bytes -= meta->size - sizeof(MmapMetadata);
+        guard.unlock();
+        munmap(meta, meta->size);
+        return;
+    }
+
+    uint8_t order = root_of(p).orders[granule_of(p)];
+    if (order == NO_BLOCK) return; // Double free (or not a block start)
+    buddy_free((char*)p, order);
+}
+
+void* srealloc(void* oldp, size_t size) {
+    if (size <= 0 ||size >= MAX_SIZE ) return nullptr;
+    if (oldp==nullptr) return smalloc(size);
+
+    std::unique_lock<std::mutex> guard(heap_lock);
+    size_t old_size;
+    if (in_heap(oldp)) {
+        int order = root_of(oldp).orders[granule_of(oldp)];
+        old_size = block_size(order);
+        if (size <= old_size) return oldp;
+
+        // Grow in place if the buddies up to the needed order are all free
+        int needed = find_order(size);
+        char* block = (char*)oldp;
+        int possible_order = order;
+        while (possible_order < needed && needed <= MAX_ORDER) {
+            char* buddy = heap_base + (((size_t)(block - heap_base)) ^ block_size(possible_order));
+            if (!is_free_node(possible_order, buddy)) break;
+            if (buddy < block) block = buddy;
+            possible_order++;
+        }
+        if (possible_order == needed && needed <= MAX_ORDER) {
+            root_of(oldp).orders[granule_of(oldp)] = NO_BLOCK;
+            block = (char*)oldp;
+            for (int i = order; i < needed; ++i) {
+                char* buddy = heap_base + (((size_t)(block - heap_base)) ^ block_size(i));
+                remove(i, buddy);
+                allocated_blocks--;
+                if (buddy < block) {
+                    block = buddy; // Move data if address changed
+                }
+            }
+            if (block != oldp) {
+                memmove(block, oldp, old_size);
+            }
+            root_of(block).orders[granule_of(block)] = needed;
+            return block;
+        }
+    } else {
+        old_size = ((MmapMetadata*)oldp - 1)->size - sizeof(MmapMetadata);
+        if (size <= old_size) return oldp;
+    }
+    guard.unlock();
+
+    // Allocate new if we can't merge
+    void* new_ptr = smalloc(size);
+    if (new_ptr == nullptr) {return nullptr;}
+
+    memmove (new_ptr,oldp,old_size);
+    sfree(oldp);
+    return new_ptr;
+}
+
+size_t _num_free_blocks() {
+    return free_blocks;
+
+}
+size_t _num_free_bytes() {
+    return free_bytes;
+
+}
+size_t _num_allocated_blocks() {
+    return allocated_blocks;
+
+}
+size_t _num_allocated_bytes() {
+    return allocated_bytes;
+
+}
+// Out-of-band tables for the whole heap plus the headers of mmap blocks
+size_t _num_meta_data_bytes() {
+    return sizeof(roots) + sizeof(MmapMetadata) * mmap_blocks;
+
+}
+// Buddy blocks have no in-band header
+size_t _size_meta_data() {
+    return 0;
+}
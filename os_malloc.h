@@ -14,5 +14,20 @@ size_t _num_allocated_bytes();
 size_t _num_meta_data_bytes();
 size_t _num_free_blocks();
 size_t _size_meta_data();
+size_t _strim(); // malloc_2 and malloc_3
+
+// malloc_3 only
+size_t smalloc_usable_size(void* p);
+bool sexpand(void* p, size_t new_size);
+void* saligned_alloc(size_t alignment, size_t size);
+int sposix_memalign(void** memptr, size_t alignment, size_t size);
+size_t smalloc_batch(size_t size, size_t n, void** out);
+void sfree_batch(void** ptrs, size_t n); // sorts ptrs
+void sfree_sized(void* p, size_t size);
+size_t _num_committed_bytes();
+size_t _num_resident_bytes();
+size_t _num_mmap_cache_hits();
+size_t _num_mmap_cache_misses();
+size_t _num_mmap_cache_bytes();
 
 #endif //MALLOCS_SMALLOC_H
@@ -8,6 +8,23 @@
 
 #define MAX_MALLOC 100000000
 
+// Optional policies, see the Makefile
+#ifndef SPLIT_MIN_REMAINDER
+#define SPLIT_MIN_REMAINDER 0
+#endif
+#ifndef COALESCE
+#define COALESCE 0
+#endif
+#ifndef BEST_FIT
+#define BEST_FIT 0
+#endif
+#ifndef WILDERNESS
+#define WILDERNESS 0
+#endif
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD 0
+#endif
+
 // --- Helper Macros for Colors ---
 #define GREEN "\033[32m"
 #define RED "\033[31m"
@@ -1883,8 +1900,229 @@ void t20_random_simulation() {
     for(void* p : ptrs) sfree(p);
 }
 
+void t21_calloc_large_dirty_reuse() {
+    const size_t big = 1 << 20;
+    char* fresh = (char*)scalloc(big, 1);
+    for(size_t i=0; i<big; i++) assert(fresh[i] == 0);
+    memset(fresh, 0xFF, big);
+    sfree(fresh);
+
+    // Same block back, zeroed again even though it is far too big to memset cheaply
+    char* reused = (char*)scalloc(1, big - 100);
+    assert(reused == fresh);
+    for(size_t i=0; i<big - 100; i++) assert(reused[i] == 0);
+    sfree(reused);
+}
+
+void t22_bins_keep_first_fit() {
+    void* s1 = smalloc(20);   smalloc(1);
+    void* s2 = smalloc(40);   smalloc(1);
+    void* big = smalloc(2000); smalloc(1);
+    void* s3 = smalloc(40);   smalloc(1);
+    // Freed out of address order, into three different bins
+    sfree(s3); sfree(big); sfree(s1); sfree(s2);
+    assert(_num_free_blocks() == 4);
+
+    // Each request takes the lowest block that fits, whatever its bin
+    assert(smalloc(30) == s2);
+    assert(smalloc(30) == big);
+    assert(smalloc(40) == s3);
+    assert(smalloc(10) == s1);
+    assert(_num_free_blocks() == 0);
+    assert(_num_free_bytes() == 0);
+}
+
+void t23_split_remainder() {
+    size_t meta = _size_meta_data();
+    char* p = (char*)smalloc(1000); smalloc(1);
+    sfree(p);
+    size_t blocks = _num_allocated_blocks();
+    size_t bytes = _num_allocated_bytes();
+
+    assert(smalloc(100) == p);
+    assert(_num_allocated_blocks() == blocks + 1);
+    assert(_num_allocated_bytes() == bytes - meta);
+    assert(_num_free_blocks() == 1);
+    assert(_num_free_bytes() == 1000 - 100 - meta);
+    // The rest is a block of its own, right after the first
+    assert(smalloc(50) == p + 100 + meta);
+
+    // A remainder below the minimum stays with the block
+    char* q = (char*)smalloc(200); smalloc(1);
+    sfree(q);
+    blocks = _num_allocated_blocks();
+    assert(smalloc(200 - meta - SPLIT_MIN_REMAINDER + 1) == q);
+    assert(_num_allocated_blocks() == blocks);
+}
+
+void t24_coalesce_neighbours() {
+    size_t meta = _size_meta_data();
+    void* a = smalloc(100);
+    void* b = smalloc(100);
+    void* c = smalloc(100);
+    smalloc(1);
+    sfree(a); sfree(c);
+    assert(_num_free_blocks() == 2);
+    size_t blocks = _num_allocated_blocks();
+
+    // b merges with both sides
+    sfree(b);
+    assert(_num_free_blocks() == 1);
+    assert(_num_free_bytes() == 300 + 2 * meta);
+    assert(_num_allocated_blocks() == blocks - 2);
+    assert(_num_meta_data_bytes() == (blocks - 2) * meta);
+    assert(smalloc(300 + 2 * meta) == a);
+    assert(_num_free_blocks() == 0);
+}
+
+void t25_realloc_shrink_split() {
+    size_t meta = _size_meta_data();
+    void* p = smalloc(1000); smalloc(1);
+    assert(srealloc(p, 100) == p);
+    assert(_num_free_blocks() == 1);
+    assert(_num_free_bytes() == 1000 - 100 - meta);
+}
+
+void t26_best_fit() {
+    void* big = smalloc(300);   smalloc(1);
+    void* mid1 = smalloc(100);  smalloc(1);
+    void* small = smalloc(50);  smalloc(1);
+    void* mid2 = smalloc(100);  smalloc(1);
+    sfree(mid2); sfree(big); sfree(small); sfree(mid1);
+
+    // Smallest block that fits, the lowest one among equal sizes
+    assert(smalloc(80) == mid1);
+    assert(smalloc(80) == mid2);
+    assert(smalloc(40) == small);
+    assert(smalloc(280) == big);
+    assert(_num_free_blocks() == 0);
+    assert(_num_free_bytes() == 0);
+}
+
+void t27_best_fit_many() {
+    // Sizes freed in a scrambled order come back smallest first
+    const int count = 500;
+    std::vector<void*> ptrs(count);
+    for (int i = 0; i < count; i++) {
+        ptrs[i] = smalloc(100 + (i * 7919) % count);
+        smalloc(1);
+    }
+    for (int i = 0; i < count; i++) sfree(ptrs[(i * 31) % count]);
+    assert(_num_free_blocks() == (size_t)count);
+    for (int size = 100; size < 100 + count; size++) {
+        void* p = smalloc(size);
+        assert(p == ptrs[((size - 100) * 179) % count]);
+    }
+    assert(_num_free_blocks() == 0);
+}
+
+void t28_wilderness() {
+    // The last block grows where it is
+    char* p = (char*)smalloc(100);
+    memset(p, 'x', 100);
+    size_t blocks = _num_allocated_blocks();
+    size_t bytes = _num_allocated_bytes();
+    assert(srealloc(p, 1000) == p);
+    assert(_num_allocated_blocks() == blocks);
+    assert(_num_allocated_bytes() == bytes + 900);
+    for (int i = 0; i < 100; i++) assert(p[i] == 'x');
+    p[999] = 'y';
+
+    // So does a free last block that is too small
+    void* q = smalloc(200);
+    sfree(q);
+    assert(smalloc(500) == q);
+    assert(_num_allocated_blocks() == blocks + 1);
+    assert(_num_allocated_bytes() == bytes + 900 + 500);
+    assert(_num_free_blocks() == 0);
+
+    // A block followed by a free one at the break grows into it
+    char* r = (char*)smalloc(300);
+    void* top = smalloc(100);
+    sfree(top);
+    assert(srealloc(r, 350) == r);
+    assert(srealloc(r, 2000) == r);
+
+    // Anything below the top still moves
+    void* a = smalloc(100);
+    smalloc(100);
+    assert(srealloc(a, 200) != a);
+}
+
+void t29_strim_free_tail() {
+    size_t meta = _size_meta_data();
+    void* keep = smalloc(100);
+    void* a = smalloc(1000);
+    void* b = smalloc(5000);
+    char* brk = (char*)sbrk(0);
+    assert(_strim() == 0); // the top block is in use
+    sfree(a);
+    assert(_strim() == 0); // a is below it
+
+    size_t blocks = _num_allocated_blocks();
+    size_t bytes = _num_allocated_bytes();
+    sfree(b);
+    assert(_strim() == 2 * meta + 6000);
+    assert((char*)sbrk(0) == brk - 2 * meta - 6000);
+    assert(_num_allocated_blocks() == blocks - 2);
+    assert(_num_allocated_bytes() == bytes - 6000);
+    assert(_num_free_blocks() == 0);
+    assert(_num_free_bytes() == 0);
+    assert(_num_meta_data_bytes() == (blocks - 2) * meta);
+
+    // The heap grows again from where it was cut
+    assert(smalloc(50) == a);
+    sfree(keep);
+    assert(_strim() == 0);
+}
+
+void t30_trim_threshold() {
+    size_t meta = _size_meta_data();
+    smalloc(100);
+    char* brk = (char*)sbrk(0);
+    void* small = smalloc(10);
+    sfree(small);
+    if (TRIM_THRESHOLD > 10 + meta) {
+        assert(_num_free_blocks() == 1);
+        assert((char*)sbrk(0) == brk + meta + 10);
+    }
+
+    void* big = smalloc(TRIM_THRESHOLD);
+    size_t blocks = _num_allocated_blocks();
+    sfree(big);
+    assert((char*)sbrk(0) == brk);
+    assert(_num_free_blocks() == 0);
+    assert(_num_allocated_blocks() < blocks);
+}
+
 int main() {
     std::cout << "malloc_2 tests:" << std::endl;
+    if (SPLIT_MIN_REMAINDER > 0 || COALESCE || BEST_FIT || WILDERNESS || TRIM_THRESHOLD > 0) {
+        // The Part 2 tests expect whole-block reuse without merging
+        std::cout << "--- Policy Tests (split remainder " << SPLIT_MIN_REMAINDER
+                  << ", coalescing " << (COALESCE ? "on" : "off")
+                  << ", " << (BEST_FIT ? "best" : "first") << " fit"
+                  << ", wilderness " << (WILDERNESS ? "on" : "off")
+                  << ", trim threshold " << TRIM_THRESHOLD << ") ---" << std::endl;
+        if (SPLIT_MIN_REMAINDER > 0) {
+            run_test(t23_split_remainder, "Split Remainder", 23);
+            run_test(t25_realloc_shrink_split, "Realloc Shrink Split", 25);
+        }
+        if (COALESCE) {
+            run_test(t24_coalesce_neighbours, "Coalesce Neighbours", 24);
+        }
+        if (BEST_FIT) {
+            run_test(t26_best_fit, "Best Fit", 26);
+            run_test(t27_best_fit_many, "Best Fit Many", 27);
+        }
+        if (WILDERNESS) {
+            run_test(t28_wilderness, "Wilderness", 28);
+        }
+        if (TRIM_THRESHOLD > 0) {
+            run_test(t30_trim_threshold, "Trim Threshold", 30);
+        }
+        return 0;
+    }
     //test_basic_malloc();
     //test_block_reuse();
     //test_free_block_statistics();
@@ -2105,6 +2343,9 @@ int main() {
     run_test(t18_deep_search, "Deep List Search", 18);
     run_test(t19_exact_limit_stress, "Exact Limit Stress", 19);
     run_test(t20_random_simulation, "Random Simulation", 20);
+    run_test(t21_calloc_large_dirty_reuse, "Calloc Large Dirty Reuse", 21);
+    run_test(t22_bins_keep_first_fit, "Bins Keep First Fit", 22);
+    run_test(t29_strim_free_tail, "Trim Free Tail", 29);
 
     std::cout << "--- ALL 100 TESTS COMPLETED ---" << std::endl;
     
@@ -1,7 +1,10 @@
 #include <iostream>
 #include <cassert>
 #include <cstring>
+#include <cerrno>
 #include <stdint.h>
+#include <thread>
+#include <vector>
 #include "os_malloc.h"
 
 #define MMAP_THRESHOLD (128 * 1024)
@@ -45,9 +48,13 @@ void test_block_splitting() {
 
 void test_large_allocation() {
     std::cout << "Test 4: Large allocation (mmap)... ";
+    size_t meta_bytes = _num_meta_data_bytes();
     void* large = smalloc(MMAP_THRESHOLD + 1000);
     assert(large != NULL);
+    // The mapping also starts with its list links
+    assert(_num_meta_data_bytes() == meta_bytes + _size_meta_data() + 2 * sizeof(void*));
     sfree(large);
+    assert(_num_meta_data_bytes() == meta_bytes);
     std::cout << "PASSED" << std::endl;
 }
 
@@ -75,6 +82,407 @@ void test_realloc() {
     std::cout << "PASSED" << std::endl;
 }
 
+void threaded_worker(int id) {
+    const int count = 500;
+    unsigned char* ptrs[count];
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < count; i++) {
+            ptrs[i] = static_cast<unsigned char*>(smalloc(16 + (i % 4) * 100));
+            assert(ptrs[i] != NULL);
+            memset(ptrs[i], id, 16);
+        }
+        for (int i = 0; i < count; i++) {
+            for (int j = 0; j < 16; j++) assert(ptrs[i][j] == id);
+            sfree(ptrs[i]);
+        }
+    }
+}
+
+void test_threads() {
+    std::cout << "Test 7: Threaded small allocations... ";
+    std::vector<std::thread> threads;
+    for (int id = 1; id <= 4; id++) {
+        threads.emplace_back(threaded_worker, id);
+    }
+    for (auto& t : threads) t.join();
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_heap_growth() {
+    std::cout << "Test 8: Heap growth past the initial 4 MB... ";
+    const int count = 20000;
+    std::vector<void*> ptrs(count);
+    for (int i = 0; i < count; i++) {
+        ptrs[i] = smalloc(400);
+        assert(ptrs[i] != NULL);
+    }
+    assert(_num_allocated_bytes() > 32 * MMAP_THRESHOLD);
+    for (int i = 0; i < count; i++) sfree(ptrs[i]);
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_trim() {
+    std::cout << "Test 9: Trimming free root blocks... ";
+    const int count = 64;
+    void* ptrs[count];
+    for (int i = 0; i < count; i++) {
+        ptrs[i] = smalloc(60 * 1024);
+        memset(ptrs[i], 1, 60 * 1024);
+    }
+    size_t resident = _num_resident_bytes();
+    assert(resident >= count * 60 * 1024);
+    assert(_num_committed_bytes() >= resident);
+    for (int i = 0; i < count; i++) sfree(ptrs[i]);
+    assert(_strim() >= count / 2 * MMAP_THRESHOLD);
+    assert(_num_resident_bytes() < resident);
+    assert(_strim() == 0);
+    // A trimmed root handed out whole gets its header back
+    size_t free_bytes = _num_free_bytes();
+    void* root = smalloc(100000);
+    memset(root, 2, 100000);
+    sfree(root);
+    assert(_num_free_bytes() == free_bytes);
+    void* p = smalloc(60 * 1024);
+    memset(p, 2, 60 * 1024);
+    sfree(p);
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_mmap_cache() {
+    std::cout << "Test 10: Reusing freed mmap regions... ";
+    _strim();
+    size_t hits = _num_mmap_cache_hits();
+    size_t misses = _num_mmap_cache_misses();
+    size_t blocks = _num_allocated_blocks();
+    size_t bytes = _num_allocated_bytes();
+
+    void* p1 = smalloc(250 * 1024);
+    assert(_num_mmap_cache_misses() == misses + 1);
+    memset(p1, 1, 250 * 1024);
+    sfree(p1);
+    assert(_num_mmap_cache_bytes() >= 250 * 1024);
+    assert(_num_allocated_blocks() == blocks);
+    assert(_num_allocated_bytes() == bytes);
+
+    void* p2 = smalloc(240 * 1024);
+    assert(p2 == p1);
+    assert(_num_mmap_cache_hits() == hits + 1);
+    assert(_num_mmap_cache_bytes() == 0);
+    memset(p2, 2, 240 * 1024);
+    void* p3 = smalloc(2 * 1024 * 1024);
+    assert(_num_mmap_cache_misses() == misses + 2);
+    sfree(p2);
+    sfree(p3);
+    assert(_num_allocated_blocks() == blocks);
+    assert(_num_allocated_bytes() == bytes);
+
+    assert(_strim() >= 2 * 1024 * 1024 + 250 * 1024);
+    assert(_num_mmap_cache_bytes() == 0);
+
+    // Once the cache decays, any free unmaps it, even with no large requests
+    sfree(smalloc(250 * 1024));
+    assert(_num_mmap_cache_bytes() > 0);
+    usleep(1100 * 1000);
+    sfree(smalloc(5000));
+    assert(_num_mmap_cache_bytes() == 0);
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_mremap() {
+    std::cout << "Test 11: Resizing mmap blocks in place... ";
+    size_t blocks = _num_allocated_blocks();
+    size_t bytes = _num_allocated_bytes();
+    const size_t mb = 1024 * 1024;
+
+    unsigned char* p = static_cast<unsigned char*>(smalloc(mb));
+    for (size_t i = 0; i < mb; i += 4096) p[i] = (unsigned char)(i / 4096);
+    for (size_t size = 2 * mb; size <= 64 * mb; size *= 2) {
+        p = static_cast<unsigned char*>(srealloc(p, size));
+        assert(p != NULL);
+        assert(_num_allocated_blocks() == blocks + 1);
+        assert(_num_allocated_bytes() == bytes + smalloc_usable_size(p));
+        p[size - 1] = 7;
+    }
+    for (size_t i = 0; i < mb; i += 4096) assert(p[i] == (unsigned char)(i / 4096));
+
+    p = static_cast<unsigned char*>(srealloc(p, 200 * 1024));
+    assert(_num_allocated_bytes() == bytes + smalloc_usable_size(p));
+    for (size_t i = 0; i < 200 * 1024; i += 4096) assert(p[i] == (unsigned char)(i / 4096));
+    sfree(p);
+    assert(_num_allocated_blocks() == blocks);
+    assert(_num_allocated_bytes() == bytes);
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_usable_size() {
+    std::cout << "Test 12: Usable size and size classes... ";
+    void* small = smalloc(100);
+    assert(smalloc_usable_size(small) == 128 - _size_meta_data());
+    sfree(small);
+
+    size_t request = MMAP_THRESHOLD + 1000;
+    char* p = static_cast<char*>(smalloc(request));
+    size_t usable = smalloc_usable_size(p);
+    assert(usable >= request);
+    assert((usable + 2 * _size_meta_data()) % 4096 == 0);
+    memset(p, 3, usable);
+    assert(srealloc(p, usable) == p);
+
+    // 3 MB and 3.5 MB share a 2 MB-aligned class
+    p = static_cast<char*>(srealloc(p, 3 * 1024 * 1024));
+    usable = smalloc_usable_size(p);
+    assert((usable + 2 * _size_meta_data()) % (2 * 1024 * 1024) == 0);
+    assert(srealloc(p, 3 * 1024 * 1024 + 512 * 1024) == p);
+    assert(smalloc_usable_size(p) == usable);
+    assert(p[request - 1] == 3);
+    sfree(p);
+    std::cout << "PASSED" << std::endl;
+}
+
+bool all_zero(const char* p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] != 0) return false;
+    }
+    return true;
+}
+
+void test_calloc_reuse() {
+    std::cout << "Test 13: scalloc on fresh and reused blocks... ";
+    _strim();
+    const size_t large = 3 * MMAP_THRESHOLD + 123;
+    char* p = static_cast<char*>(scalloc(1, large));
+    assert(all_zero(p, large));
+    memset(p, 0xff, large);
+    sfree(p);
+    char* q = static_cast<char*>(scalloc(large, 1));
+    assert(q == p); // same mapping, back from the mmap cache
+    assert(all_zero(q, large));
+    sfree(q);
+
+    char* small = static_cast<char*>(smalloc(1000));
+    memset(small, 0xff, 1000);
+    sfree(small);
+    small = static_cast<char*>(scalloc(10, 100));
+    assert(all_zero(small, 1000));
+    sfree(small);
+
+    // A trimmed root block comes back zeroed, with a valid header
+    assert(_strim() > 0);
+    size_t free_bytes = _num_free_bytes();
+    char* root = static_cast<char*>(scalloc(100, 1000));
+    assert(all_zero(root, 100000));
+    memset(root, 0xff, 100000);
+    sfree(root);
+    assert(_num_free_bytes() == free_bytes);
+
+    // An aligned block cut from a zeroed root: freeing it merges the dirty
+    // payload with the untouched pieces around it. Holding blocks of its
+    // order until one splits a root leaves the rest of that root for it.
+    assert(_strim() > 0);
+    std::vector<void*> held;
+    do {
+        held.push_back(smalloc(8000));
+    } while (((uintptr_t)held.back() - _size_meta_data()) % (128 * 1024) != 0);
+    // On its own thread, so the exiting thread cache frees the granule too
+    std::thread([] {
+        void* aligned = saligned_alloc(4096, 4096);
+        memset(aligned, 0xab, 4096);
+        sfree(aligned);
+    }).join();
+    char* merged = static_cast<char*>(scalloc(1, 8000));
+    assert(all_zero(merged, 8000));
+    sfree(merged);
+    sfree_batch(held.data(), held.size());
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_small_objects() {
+    std::cout << "Test 14: Small objects share slabs... ";
+    const int count = 1000;
+    size_t in_use = _num_allocated_bytes() - _num_free_bytes();
+    std::vector<unsigned char*> ptrs(count);
+    for (int i = 0; i < count; i++) {
+        ptrs[i] = static_cast<unsigned char*>(smalloc(24));
+        assert(((uintptr_t)ptrs[i] % 16) == 0);
+        assert(smalloc_usable_size(ptrs[i]) == 32);
+        memset(ptrs[i], i % 256, 24);
+    }
+    // 32-byte slots, against 128-byte buddy blocks without slabs
+    assert(_num_allocated_bytes() - _num_free_bytes() - in_use < count * 40);
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < 24; j++) assert(ptrs[i][j] == i % 256);
+    }
+
+    unsigned char* moved = static_cast<unsigned char*>(srealloc(ptrs[0], 200));
+    for (int j = 0; j < 24; j++) assert(moved[j] == 0);
+    sfree(moved);
+    sfree(ptrs[0]); // Double free of a slot
+    for (int i = 1; i < count; i++) sfree(ptrs[i]);
+    // Only the last slab of the class stays behind
+    assert(_num_allocated_bytes() - _num_free_bytes() - in_use <= 1024);
+
+    for (size_t size = 1; size <= 96; size++) {
+        void* p = smalloc(size);
+        assert(smalloc_usable_size(p) >= size);
+        memset(p, 1, size);
+        sfree(p);
+    }
+    // At most one 1 KB slab left per 16-byte size class
+    assert(_num_allocated_bytes() - _num_free_bytes() - in_use <= 6 * 1024);
+    std::cout << "PASSED" << std::endl;
+}
+
+size_t heap_in_use() {
+    return _num_allocated_bytes() - _num_free_bytes();
+}
+
+void test_aligned_alloc() {
+    std::cout << "Test 15: Aligned allocation... ";
+    const size_t alignments[] = {32, 64, 512, 4096, 65536, 2 * 1024 * 1024};
+    const size_t sizes[] = {1, 100, 5000, 200000};
+    size_t blocks_in_use = _num_allocated_blocks() - _num_free_blocks();
+    size_t in_use = heap_in_use();
+    for (size_t alignment : alignments) {
+        for (size_t size : sizes) {
+            unsigned char* p = static_cast<unsigned char*>(saligned_alloc(alignment, size));
+            assert(p != NULL);
+            assert((uintptr_t)p % alignment == 0);
+            size_t usable = smalloc_usable_size(p);
+            assert(usable >= size);
+            memset(p, 0xAB, usable);
+            unsigned char* q = static_cast<unsigned char*>(srealloc(p, usable + 1));
+            for (size_t i = 0; i < size; i++) assert(q[i] == 0xAB);
+            sfree(q);
+        }
+    }
+    assert(_num_allocated_blocks() - _num_free_blocks() == blocks_in_use);
+    assert(heap_in_use() == in_use);
+
+    // A page-aligned page costs a page plus one granule, not two pages
+    void* page = saligned_alloc(4096, 4096);
+    assert(heap_in_use() - in_use <= 4096 + 128);
+    sfree(page);
+    assert(heap_in_use() == in_use);
+
+    void* p = NULL;
+    assert(sposix_memalign(&p, 24, 100) == EINVAL);
+    assert(sposix_memalign(&p, 4, 100) == EINVAL);
+    assert(saligned_alloc(48, 100) == NULL);
+    // Alignments past MAX_SIZE would need a mapping larger than a header can describe
+    assert(saligned_alloc((size_t)1 << 32, 100) == NULL);
+    assert(sposix_memalign(&p, (size_t)1 << 32, 100) == ENOMEM);
+    assert(sposix_memalign(&p, 256, 100) == 0);
+    assert((uintptr_t)p % 256 == 0);
+    sfree(p);
+    assert(saligned_alloc(16, 40) != NULL);
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_batch() {
+    std::cout << "Test 16: Batch allocation and free... ";
+    const size_t sizes[] = {24, 200, 3000, 200000};
+    const size_t count = 700;
+    std::vector<void*> ptrs(count);
+    for (size_t size : sizes) {
+        size_t n = size > MMAP_THRESHOLD ? 5 : count;
+        size_t blocks = _num_allocated_blocks();
+        size_t blocks_in_use = _num_allocated_blocks() - _num_free_blocks();
+        size_t in_use = heap_in_use();
+        assert(smalloc_batch(size, n, ptrs.data()) == n);
+        for (size_t i = 0; i < n; i++) {
+            assert(smalloc_usable_size(ptrs[i]) >= size);
+            memset(ptrs[i], (int)i, size);
+        }
+        if (size > 96 && size < MMAP_THRESHOLD) {
+            assert(_num_allocated_blocks() - _num_free_blocks() == blocks_in_use + n);
+        }
+        for (size_t i = 0; i < n; i++) {
+            assert(static_cast<unsigned char*>(ptrs[i])[size - 1] == (unsigned char)i);
+        }
+        // Freed in scrambled order, with a duplicate and a NULL
+        std::vector<void*> batch(ptrs.rbegin() + (count - n), ptrs.rend());
+        std::swap(batch[0], batch[n / 2]);
+        batch.push_back(batch[n / 3]);
+        batch.push_back(NULL);
+        sfree_batch(batch.data(), batch.size());
+        if (size > 96) {
+            assert(_num_allocated_blocks() == blocks);
+        }
+        assert(heap_in_use() <= in_use + 1024); // the last slab of a class stays
+    }
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_sized_free() {
+    std::cout << "Test 17: Sized free... ";
+    const size_t sizes[] = {1, 16, 17, 96, 97, 200, 3000, 100000, 200000};
+    size_t blocks = _num_allocated_blocks();
+    size_t in_use = heap_in_use();
+    for (int round = 0; round < 3; round++) {
+        void* ptrs[9];
+        for (int i = 0; i < 9; i++) {
+            ptrs[i] = round == 1 ? scalloc(1, sizes[i]) : smalloc(sizes[i]);
+            memset(ptrs[i], 0x5A, sizes[i]);
+        }
+        for (int i = 0; i < 9; i++) sfree_sized(ptrs[i], sizes[i]);
+    }
+    // srealloc shrinks in place, so the block can be larger than the size says
+    sfree_sized(srealloc(smalloc(200), 50), 50);
+    sfree_sized(srealloc(smalloc(2000), 200), 200);
+    sfree_sized(srealloc(smalloc(200000), 100), 100);
+    assert(_num_allocated_blocks() == blocks);
+    assert(heap_in_use() <= in_use + 2 * 1024); // up to one slab for 16 and 96 bytes stays
+    sfree_sized(NULL, 10);
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_expand() {
+    std::cout << "Test 18: Growing blocks in place... ";
+    void* halves[2];
+    // Two 512-byte buddies cut from the same block
+    assert(smalloc_batch(400, 2, halves) == 2);
+    char* low = static_cast<char*>(halves[0]);
+    char* high = static_cast<char*>(halves[1]);
+    assert(high == low + 512);
+    memset(low, 7, 400);
+    assert(sexpand(low, smalloc_usable_size(low)));
+    assert(!sexpand(low, 900)); // the buddy above is in use
+    // The thread caches are on since test 7, sfree_batch bypasses them
+    sfree_batch(&halves[1], 1);
+    size_t blocks = _num_allocated_blocks();
+    assert(sexpand(low, 900));
+    assert(smalloc_usable_size(low) >= 900);
+    assert(_num_allocated_blocks() == blocks - 1);
+    for (int i = 0; i < 400; i++) assert(low[i] == 7);
+    sfree(low);
+
+    // The upper half cannot grow without moving, srealloc can
+    assert(smalloc_batch(400, 2, halves) == 2);
+    low = static_cast<char*>(halves[0]);
+    high = static_cast<char*>(halves[1]);
+    sfree_batch(&halves[0], 1);
+    assert(!sexpand(high, 900));
+    assert(srealloc(high, 900) == low);
+    sfree(low);
+
+    void* slot = smalloc(24);
+    assert(sexpand(slot, 32));
+    assert(!sexpand(slot, 40));
+    sfree(slot);
+
+    char* large = static_cast<char*>(smalloc(200000));
+    size_t usable = smalloc_usable_size(large);
+    assert(sexpand(large, usable));
+    if (sexpand(large, usable + 1)) {
+        assert(smalloc_usable_size(large) > usable);
+        large[usable] = 1;
+    } else {
+        assert(smalloc_usable_size(large) == usable);
+    }
+    sfree(large);
+    std::cout << "PASSED" << std::endl;
+}
+
 int main() {
     std::cout << "malloc_3 tests:" << std::endl;
     test_alignment();
@@ -83,6 +491,18 @@ int main() {
     test_large_allocation();
     test_statistics();
     test_realloc();
+    test_threads();
+    test_heap_growth();
+    test_trim();
+    test_mmap_cache();
+    test_mremap();
+    test_usable_size();
+    test_calloc_reuse();
+    test_small_objects();
+    test_aligned_alloc();
+    test_batch();
+    test_sized_free();
+    test_expand();
     std::cout << "All tests PASSED" << std::endl;
     return 0;
 }
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <stdint.h>
 #include "os_malloc.h"
 
 void test_basic() {
@@ -10,9 +12,61 @@ void test_basic() {
     std::cout << "PASSED" << std::endl;
 }
 
+void test_exact_fit() {
+    std::cout << "Test 2: Power-of-two sizes fit exactly... ";
+    size_t initial_free = _num_free_bytes();
+    void* p1 = smalloc(4096);
+    void* p2 = smalloc(128);
+    assert(p1 != NULL && p2 != NULL);
+    assert(_num_free_bytes() == initial_free - 4096 - 128);
+    sfree(p1);
+    sfree(p2);
+    assert(_num_free_bytes() == initial_free);
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_natural_alignment() {
+    std::cout << "Test 3: Natural alignment... ";
+    void* p1 = smalloc(4096);
+    void* p2 = smalloc(64 * 1024);
+    assert(((uintptr_t)p1 % 4096) == 0);
+    assert(((uintptr_t)p2 % (64 * 1024)) == 0);
+    sfree(p1);
+    sfree(p2);
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_merging() {
+    std::cout << "Test 4: Blocks merge back... ";
+    size_t initial_blocks = _num_free_blocks();
+    void* ptrs[64];
+    for (int i = 0; i < 64; i++) ptrs[i] = smalloc(120 + i);
+    for (int i = 0; i < 64; i++) sfree(ptrs[i]);
+    assert(_num_free_blocks() == initial_blocks);
+    sfree(ptrs[0]); // double free is ignored
+    assert(_num_free_blocks() == initial_blocks);
+    std::cout << "PASSED" << std::endl;
+}
+
+void test_large_and_realloc() {
+    std::cout << "Test 5: Large blocks and realloc... ";
+    char* p = static_cast<char*>(smalloc(100));
+    strcpy(p, "buddy");
+    p = static_cast<char*>(srealloc(p, 3000));
+    assert(strcmp(p, "buddy") == 0);
+    p = static_cast<char*>(srealloc(p, 300 * 1024));
+    assert(strcmp(p, "buddy") == 0);
+    sfree(p);
+    std::cout << "PASSED" << std::endl;
+}
+
 int main() {
     std::cout << "malloc_4 tests (optional):" << std::endl;
     test_basic();
+    test_exact_fit();
+    test_natural_alignment();
+    test_merging();
+    test_large_and_realloc();
     std::cout << "All tests PASSED" << std::endl;
     return 0;
 }